@@ -0,0 +1,179 @@
+#include "asyncoutput.h"
+#include "utils.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <unistd.h>
+
+/* Writes the block, retrying partial writes. */
+static void writeAll(int fd, const char *data, size_t size)
+{
+    while (size > 0)
+    {
+	ssize_t written = write(fd, data, size);
+	if (written < 0 && errno == EINTR)
+	    continue;
+	if (written <= 0)
+	{
+	    throw std::runtime_error(Formatter() << "Could not write flash data: " << strerror(errno));
+	}
+	data += written;
+	size -= written;
+    }
+}
+
+AsyncOutputBuffer::AsyncOutputBuffer(int fd, size_t blockSize, size_t blocks) :
+    AsyncOutputBuffer([fd](const char *data, size_t size) { writeAll(fd, data, size); }, blockSize, blocks)
+{
+}
+
+AsyncOutputBuffer::AsyncOutputBuffer(BlockSink sink, size_t blockSize, size_t blocks) :
+    m_sink(sink),
+    m_blockSize(blockSize)
+{
+    for (size_t i = 0; i < blocks; i++)
+    {
+	void *block = nullptr;
+	if (posix_memalign(&block, sysconf(_SC_PAGESIZE), blockSize) != 0)
+	{
+	    for (auto allocated : m_blocks)
+		free(allocated);
+	    throw std::runtime_error("Could not allocate output buffers.");
+	}
+	m_blocks.push_back((char *)block);
+	m_free.push_back(i);
+    }
+
+    m_current = m_free.front();
+    m_free.pop_front();
+    setp(m_blocks[m_current], m_blocks[m_current] + m_blockSize);
+
+    m_writer = std::thread(&AsyncOutputBuffer::writerLoop, this);
+}
+
+AsyncOutputBuffer::~AsyncOutputBuffer()
+{
+    try
+    {
+	finish();
+    }
+    catch (std::exception &)
+    {
+	// Errors are reported by an explicit finish()
+    }
+
+    for (auto block : m_blocks)
+	free(block);
+}
+
+/* Queues the filled part of the current block for writing and continues in a
+ * free block, waiting for the writer if all blocks are in flight. Returns
+ * false once a write has failed. */
+bool AsyncOutputBuffer::submit()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (!m_error.empty())
+	return false;
+
+    size_t size = pptr() - pbase();
+    if (size > 0)
+    {
+	m_full.push_back(std::make_pair(m_current, size));
+	m_cond.notify_all();
+
+	m_cond.wait(lock, [this]() { return !m_free.empty() || !m_error.empty(); });
+	if (!m_error.empty())
+	    return false;
+
+	m_current = m_free.front();
+	m_free.pop_front();
+    }
+    setp(m_blocks[m_current], m_blocks[m_current] + m_blockSize);
+
+    return m_error.empty();
+}
+
+AsyncOutputBuffer::int_type AsyncOutputBuffer::overflow(int_type ch)
+{
+    if (!submit())
+	return traits_type::eof();
+
+    if (!traits_type::eq_int_type(ch, traits_type::eof()))
+    {
+	*pptr() = traits_type::to_char_type(ch);
+	pbump(1);
+    }
+    return traits_type::not_eof(ch);
+}
+
+/* Queues buffered data and waits until everything has been written. */
+int AsyncOutputBuffer::sync()
+{
+    if (!submit())
+	return -1;
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cond.wait(lock, [this]() { return m_full.empty() || !m_error.empty(); });
+
+    return m_error.empty() ? 0 : -1;
+}
+
+void AsyncOutputBuffer::finish()
+{
+    if (!m_writer.joinable())
+	return;
+
+    sync();
+    {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_stop = true;
+	m_cond.notify_all();
+    }
+    m_writer.join();
+
+    if (!m_error.empty())
+    {
+	throw std::runtime_error(m_error);
+    }
+}
+
+void AsyncOutputBuffer::writerLoop()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    while (true)
+    {
+	m_cond.wait(lock, [this]() { return !m_full.empty() || m_stop; });
+	if (m_full.empty())
+	    return;
+
+	size_t block = m_full.front().first;
+	size_t size = m_full.front().second;
+	lock.unlock();
+
+	std::string error;
+	try
+	{
+	    m_sink(m_blocks[block], size);
+	}
+	catch (std::exception &e)
+	{
+	    error = e.what();
+	}
+
+	lock.lock();
+	m_full.pop_front();
+	m_free.push_back(block);
+	if (!error.empty())
+	{
+	    // Later blocks are dropped, the producer learns about it on its next submit
+	    m_error = error;
+	    for (auto &full : m_full)
+		m_free.push_back(full.first);
+	    m_full.clear();
+	}
+	m_cond.notify_all();
+    }
+}
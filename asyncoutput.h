@@ -0,0 +1,61 @@
+#ifndef ASYNC_OUTPUT_H
+#define ASYNC_OUTPUT_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Stream buffer writing to a file descriptor from a background thread. Output
+ * is collected in a few large, page aligned blocks that are reused; while one
+ * block is written out with plain write() calls the next one fills, so the
+ * producer (reading the flash over USB) and the writes to a file or pipe
+ * overlap. Works with non-seekable outputs such as stdout. Instead of a file
+ * descriptor the blocks can be handed to any consumer, e.g. a digest.
+ */
+class AsyncOutputBuffer : public std::streambuf
+{
+public:
+    typedef std::function<void(const char *data, size_t size)> BlockSink;
+
+    explicit AsyncOutputBuffer(int fd, size_t blockSize = 1024 * 1024, size_t blocks = 4);
+    explicit AsyncOutputBuffer(BlockSink sink, size_t blockSize = 1024 * 1024, size_t blocks = 4);
+    ~AsyncOutputBuffer();
+
+    // Writes out all data and stops the writer; throws if a write failed
+    void finish();
+
+protected:
+    int_type overflow(int_type ch);
+    int sync();
+
+private:
+    BlockSink m_sink;
+    size_t m_blockSize;
+    std::vector<char *> m_blocks;
+
+    // Indexes into m_blocks; the writer thread owns the front of m_full
+    std::deque<size_t> m_free;
+    std::deque<std::pair<size_t, size_t>> m_full;
+    size_t m_current;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::thread m_writer;
+    bool m_stop = false;
+    std::string m_error;
+
+    bool submit();
+    void writerLoop();
+
+    AsyncOutputBuffer(const AsyncOutputBuffer &);
+    AsyncOutputBuffer & operator = (AsyncOutputBuffer &);
+};
+
+#endif // ASYNC_OUTPUT_H
@@ -0,0 +1,25 @@
+#include "chipprofiles.h"
+
+const std::vector<ChipProfile> &chipProfiles()
+{
+    static const std::vector<ChipProfile> profiles =
+    {
+	makeChipProfile<W25Q128JV>()
+    };
+
+    return profiles;
+}
+
+const ChipProfile *findChipProfile(const uint8_t jedecId[3])
+{
+    for (auto &profile : chipProfiles())
+    {
+	if (profile.config.manufacturerId == jedecId[0] &&
+	    profile.config.ID15_ID8 == jedecId[1] &&
+	    profile.config.ID7_ID0 == jedecId[2])
+	{
+	    return &profile;
+	}
+    }
+    return nullptr;
+}
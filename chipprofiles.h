@@ -0,0 +1,182 @@
+#ifndef CHIP_PROFILES_H
+#define CHIP_PROFILES_H
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "ftdispi.h"
+
+/*
+ * Compile-time chip profiles. Each chip is described by a traits struct
+ * (geometry, address width, opcodes, timings); ChipCommands turns the traits
+ * into constant MPSSE command headers and ChipAccess uses them for the hot
+ * program and read paths, so no per-page header has to be assembled at run
+ * time. chipProfiles() lists one instantiation per chip for dispatch on the
+ * JEDEC ID.
+ */
+
+struct W25Q128JV
+{
+    static constexpr const char *manufacturerName = "Winbond";
+    static constexpr const char *memoryName = "W25Q128JV";
+
+    static constexpr uint8_t manufacturerId = 0xEF;
+    static constexpr uint8_t ID15_ID8 = 0x40;
+    static constexpr uint8_t ID7_ID0 = 0x18;
+
+    static constexpr uint32_t size = 16 * 1024 * 1024;
+    static constexpr uint32_t pageSize = 256;
+    static constexpr uint32_t addressBytes = 3;
+
+    static constexpr uint8_t opWriteEnable = 0x06;
+    static constexpr uint8_t opPageProgram = 0x02;
+    static constexpr uint8_t opRead = 0x03;
+
+    // Times in us (page program) and ms (erase)
+    static constexpr uint32_t pageProgramTime = 800;
+    static constexpr uint32_t blockEraseTime64k = 2000;
+    static constexpr uint32_t blockEraseTime64kTyp = 150;
+    static constexpr uint32_t chipEraseTimeTyp = 40000;
+};
+
+// SCK, DO, DI and CS on bits 0 to 3 of the low byte, as set up by ftdispi
+struct DefaultPins
+{
+    static constexpr uint8_t cs_bits = 0x08;
+    static constexpr uint8_t pindir = 0x0b;
+};
+
+template <class Chip, class Pins = DefaultPins>
+struct ChipCommands
+{
+    static constexpr uint32_t programLength = 1 + Chip::addressBytes + Chip::pageSize;
+    static constexpr uint32_t readLength = 1 + Chip::addressBytes;
+
+    // Write enable, then chip select and the page program opcode. The page address follows.
+    static constexpr uint8_t programHeader[] = {
+	SET_BITS_LOW, 0 & ~Pins::cs_bits, Pins::pindir,
+	DATA_OUT(1),
+	Chip::opWriteEnable,
+	SET_BITS_LOW, Pins::cs_bits, Pins::pindir,
+	SET_BITS_LOW, 0 & ~Pins::cs_bits, Pins::pindir,
+	DATA_OUT(programLength),
+	Chip::opPageProgram
+    };
+
+    // Chip deselect and the idle clocks for the page program time, filled in per job
+    static constexpr uint8_t programTrailer[] = {
+	SET_BITS_LOW, Pins::cs_bits, Pins::pindir,
+	0x8F, 0, 0
+    };
+
+    // Chip select and the read opcode. The address follows.
+    static constexpr uint8_t readHeader[] = {
+	SET_BITS_LOW, 0 & ~Pins::cs_bits, Pins::pindir,
+	DATA_OUT(readLength),
+	Chip::opRead
+    };
+
+    static constexpr size_t programPageBytes =
+	sizeof(programHeader) + Chip::addressBytes + Chip::pageSize + sizeof(programTrailer);
+};
+
+template <class Chip, class Pins>
+constexpr uint8_t ChipCommands<Chip, Pins>::programHeader[];
+
+template <class Chip, class Pins>
+constexpr uint8_t ChipCommands<Chip, Pins>::programTrailer[];
+
+template <class Chip, class Pins>
+constexpr uint8_t ChipCommands<Chip, Pins>::readHeader[];
+
+template <class Chip, class Pins = DefaultPins>
+struct ChipAccess
+{
+    typedef ChipCommands<Chip, Pins> Commands;
+
+    static inline uint8_t *putAddress(uint8_t *out, uint32_t addr)
+    {
+	for (int i = Chip::addressBytes - 1; i >= 0; i--)
+	{
+	    *out++ = (uint8_t)(addr >> (8 * i));
+	}
+	return out;
+    }
+
+    /* Queues page programs for whole, aligned pages, each followed by idleBytes
+     * idle clocks. */
+    static void programPages(ftditransaction &t, uint32_t addr, const uint8_t *data, uint32_t pages, uint32_t idleBytes)
+    {
+	uint8_t trailer[sizeof(Commands::programTrailer)];
+	std::memcpy(trailer, Commands::programTrailer, sizeof(trailer));
+	trailer[sizeof(trailer) - 2] = (uint8_t)(idleBytes - 1);
+	trailer[sizeof(trailer) - 1] = (uint8_t)((idleBytes - 1) >> 8);
+
+	uint8_t *out = t.reserve(pages * Commands::programPageBytes);
+	for (uint32_t i = 0; i < pages; i++)
+	{
+	    std::memcpy(out, Commands::programHeader, sizeof(Commands::programHeader));
+	    out = putAddress(out + sizeof(Commands::programHeader), addr);
+	    std::memcpy(out, data, Chip::pageSize);
+	    out += Chip::pageSize;
+	    std::memcpy(out, trailer, sizeof(trailer));
+	    out += sizeof(trailer);
+
+	    addr += Chip::pageSize;
+	    data += Chip::pageSize;
+	}
+    }
+
+    static ftdiresult_ptr read(ftditransaction &t, uint32_t addr, uint32_t n)
+    {
+	uint8_t *out = t.reserve(sizeof(Commands::readHeader) + Chip::addressBytes);
+	std::memcpy(out, Commands::readHeader, sizeof(Commands::readHeader));
+	putAddress(out + sizeof(Commands::readHeader), addr);
+
+	ftdiresult_ptr result = t.data_in(n);
+	t.chip_deselect();
+	return result;
+    }
+
+    static FlashConfig config()
+    {
+	return {
+	    Chip::manufacturerName, Chip::manufacturerId, Chip::ID15_ID8, Chip::ID7_ID0, Chip::memoryName,
+	    Chip::size, Chip::pageProgramTime, Chip::blockEraseTime64k, Chip::blockEraseTime64kTyp,
+	    Chip::chipEraseTimeTyp, 0, 0
+	};
+    }
+};
+
+/* Runtime view of a chip profile, selected by JEDEC ID. */
+struct ChipProfile
+{
+    FlashConfig config;
+    uint32_t pageSize;
+    uint8_t cs_bits;
+    uint8_t pindir;
+
+    void (*programPages)(ftditransaction &t, uint32_t addr, const uint8_t *data, uint32_t pages, uint32_t idleBytes);
+    ftdiresult_ptr (*read)(ftditransaction &t, uint32_t addr, uint32_t n);
+    size_t programPageBytes;
+};
+
+template <class Chip, class Pins = DefaultPins>
+ChipProfile makeChipProfile()
+{
+    return {
+	ChipAccess<Chip, Pins>::config(),
+	Chip::pageSize,
+	Pins::cs_bits,
+	Pins::pindir,
+	&ChipAccess<Chip, Pins>::programPages,
+	&ChipAccess<Chip, Pins>::read,
+	ChipCommands<Chip, Pins>::programPageBytes
+    };
+}
+
+const std::vector<ChipProfile> &chipProfiles();
+const ChipProfile *findChipProfile(const uint8_t jedecId[3]);
+
+#endif // CHIP_PROFILES_H
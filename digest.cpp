@@ -0,0 +1,239 @@
+#include "digest.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+
+struct Crc32Table
+{
+    uint32_t entry[256];
+
+    Crc32Table()
+    {
+	for (uint32_t i = 0; i < 256; i++)
+	{
+	    uint32_t c = i;
+	    for (int k = 0; k < 8; k++)
+	    {
+		c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+	    }
+	    entry[i] = c;
+	}
+    }
+};
+
+uint32_t crc32(const uint8_t *data, size_t size, uint32_t crc)
+{
+    static const Crc32Table table;
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+    {
+	crc = table.entry[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotr(uint32_t x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+Sha256::Sha256() :
+    m_length(0),
+    m_blockSize(0)
+{
+    static const uint32_t init[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    std::memcpy(m_state, init, sizeof(m_state));
+}
+
+void Sha256::transform(const uint8_t *block)
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+    {
+	w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+	    (uint32_t)block[i * 4 + 2] << 8 | (uint32_t)block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++)
+    {
+	uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+	uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+	w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+    uint32_t e = m_state[4], f = m_state[5], g = m_state[6], h = m_state[7];
+
+    for (int i = 0; i < 64; i++)
+    {
+	uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+	uint32_t ch = (e & f) ^ (~e & g);
+	uint32_t t1 = h + s1 + ch + sha256_k[i] + w[i];
+	uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+	uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+	uint32_t t2 = s0 + maj;
+
+	h = g; g = f; f = e; e = d + t1;
+	d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    m_state[0] += a; m_state[1] += b; m_state[2] += c; m_state[3] += d;
+    m_state[4] += e; m_state[5] += f; m_state[6] += g; m_state[7] += h;
+}
+
+void Sha256::update(const uint8_t *data, size_t size)
+{
+    m_length += size;
+
+    if (m_blockSize > 0)
+    {
+	size_t n = std::min(size, sizeof(m_block) - m_blockSize);
+	std::memcpy(&m_block[m_blockSize], data, n);
+	m_blockSize += n;
+	data += n;
+	size -= n;
+
+	if (m_blockSize < sizeof(m_block))
+	    return;
+
+	transform(m_block);
+	m_blockSize = 0;
+    }
+
+    while (size >= sizeof(m_block))
+    {
+	transform(data);
+	data += sizeof(m_block);
+	size -= sizeof(m_block);
+    }
+
+    std::memcpy(m_block, data, size);
+    m_blockSize = size;
+}
+
+void Sha256::final(uint8_t digest[32])
+{
+    uint64_t bits = m_length * 8;
+
+    uint8_t pad[72] = { 0x80 };
+    size_t padSize = (m_blockSize < 56) ? 56 - m_blockSize : 120 - m_blockSize;
+    for (int i = 0; i < 8; i++)
+    {
+	pad[padSize + i] = (uint8_t)(bits >> (56 - i * 8));
+    }
+    update(pad, padSize + 8);
+
+    for (int i = 0; i < 8; i++)
+    {
+	digest[i * 4] = (uint8_t)(m_state[i] >> 24);
+	digest[i * 4 + 1] = (uint8_t)(m_state[i] >> 16);
+	digest[i * 4 + 2] = (uint8_t)(m_state[i] >> 8);
+	digest[i * 4 + 3] = (uint8_t)m_state[i];
+    }
+}
+
+std::string Sha256::hex()
+{
+    uint8_t digest[32];
+    final(digest);
+
+    std::stringstream ss;
+    for (auto byte : digest)
+    {
+	ss << std::hex << std::setfill('0') << std::setw(2) << (int)byte;
+    }
+    return ss.str();
+}
+
+std::string sha256_hex(const uint8_t *data, size_t size)
+{
+    Sha256 sha;
+    sha.update(data, size);
+    return sha.hex();
+}
+
+FlashDigest::FlashDigest(uint32_t base, uint32_t sectorSize) :
+    m_sectorSize(sectorSize)
+{
+    m_range.addr = base;
+    m_range.length = 0;
+    m_range.crc = 0;
+    m_sector = m_range;
+}
+
+void FlashDigest::update(const uint8_t *data, size_t size)
+{
+    m_rangeSha.update(data, size);
+    m_range.crc = crc32(data, size, m_range.crc);
+    m_range.length += size;
+
+    while (size > 0)
+    {
+	uint32_t addr = m_sector.addr + m_sector.length;
+	size_t chunk = std::min<size_t>(m_sectorSize - addr % m_sectorSize, size);
+
+	m_sectorSha.update(data, chunk);
+	m_sector.crc = crc32(data, chunk, m_sector.crc);
+	m_sector.length += chunk;
+	if ((addr + chunk) % m_sectorSize == 0)
+	    finishSector();
+
+	data += chunk;
+	size -= chunk;
+    }
+}
+
+void FlashDigest::finishSector()
+{
+    m_sector.sha256 = m_sectorSha.hex();
+    m_sectors.push_back(m_sector);
+
+    m_sector.addr += m_sector.length;
+    m_sector.length = 0;
+    m_sector.crc = 0;
+    m_sectorSha = Sha256();
+}
+
+void FlashDigest::final()
+{
+    if (m_sector.length > 0)
+	finishSector();
+    m_range.sha256 = m_rangeSha.hex();
+}
+
+void FlashDigest::manifest(std::ostream &out) const
+{
+    std::ios::fmtflags flags = out.flags();
+    char fill = out.fill();
+
+    auto line = [&out](const char *kind, const Entry &entry) {
+	out << kind << " 0x" << std::hex << std::setfill('0') << std::setw(6) << entry.addr <<
+	    std::dec << " " << entry.length <<
+	    " crc32=" << std::hex << std::setw(8) << entry.crc <<
+	    " sha256=" << entry.sha256 << std::endl;
+    };
+
+    line("range ", m_range);
+    for (auto &sector : m_sectors)
+    {
+	line("sector", sector);
+    }
+
+    out.flags(flags);
+    out.fill(fill);
+}
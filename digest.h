@@ -0,0 +1,71 @@
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <cstdint>
+#include <cstddef>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/* CRC-32 (IEEE 802.3). Pass the previous result as crc to continue a checksum. */
+uint32_t crc32(const uint8_t *data, size_t size, uint32_t crc = 0);
+
+class Sha256
+{
+public:
+    Sha256();
+
+    void update(const uint8_t *data, size_t size);
+    void final(uint8_t digest[32]);
+    std::string hex();
+
+private:
+    uint32_t m_state[8];
+    uint64_t m_length;
+    uint8_t m_block[64];
+    size_t m_blockSize;
+
+    void transform(const uint8_t *block);
+};
+
+std::string sha256_hex(const uint8_t *data, size_t size);
+
+/*
+ * SHA-256 and CRC-32 of a flash range, for the whole range and for every
+ * sector it touches. Data is fed in address order starting at the base
+ * address; sector boundaries are aligned to flash addresses.
+ */
+class FlashDigest
+{
+public:
+    struct Entry
+    {
+	uint32_t addr;
+	uint32_t length;
+	uint32_t crc;
+	std::string sha256;
+    };
+
+    explicit FlashDigest(uint32_t base, uint32_t sectorSize = 0x10000);
+
+    void update(const uint8_t *data, size_t size);
+    void final();
+
+    const Entry &range() const                  { return m_range; }
+    const std::vector<Entry> &sectors() const   { return m_sectors; }
+
+    // One line for the range, then one per sector
+    void manifest(std::ostream &out) const;
+
+private:
+    uint32_t m_sectorSize;
+    Entry m_range;
+    Sha256 m_rangeSha;
+    Entry m_sector;
+    Sha256 m_sectorSha;
+    std::vector<Entry> m_sectors;
+
+    void finishSector();
+};
+
+#endif // DIGEST_H
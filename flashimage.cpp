@@ -0,0 +1,244 @@
+#include "flashimage.h"
+#include "digest.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+const uint32_t FlashImage::pageSize;
+const uint32_t FlashDumpWriter::maxRecordSize;
+
+static const char dumpMagic[8] = { 'F', 'T', 'D', 'I', 'D', 'U', 'M', 'P' };
+static const uint32_t dumpVersion = 1;
+static const uint32_t dumpEnd = 0xffffffff;
+
+static void put32(std::ostream &out, uint32_t value)
+{
+    char bytes[4] = { (char)value, (char)(value >> 8), (char)(value >> 16), (char)(value >> 24) };
+    out.write(bytes, sizeof(bytes));
+}
+
+static uint32_t get32(std::istream &in, const std::string &path)
+{
+    uint8_t bytes[4];
+    if (!in.read((char *)bytes, sizeof(bytes)))
+    {
+	throw std::runtime_error(Formatter() << "Dump file " << path << " is truncated.");
+    }
+    return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+FlashImage::FlashImage(uint8_t fill) :
+    m_size(0),
+    m_base(0),
+    m_fill(fill)
+{
+}
+
+bool FlashImage::isBlank(const uint8_t *data, uint32_t length, uint8_t fill)
+{
+    // Compare against the first byte, then the buffer against itself shifted by one
+    return length == 0 || (data[0] == fill && memcmp(data, data + 1, length - 1) == 0);
+}
+
+bool FlashImage::isDump(const std::string &path)
+{
+    std::ifstream in(path.c_str(), std::ifstream::binary);
+    char magic[sizeof(dumpMagic)];
+
+    return in.read(magic, sizeof(magic)) && memcmp(magic, dumpMagic, sizeof(magic)) == 0;
+}
+
+uint32_t FlashImage::dumpBase(const std::string &path)
+{
+    std::ifstream in(path.c_str(), std::ifstream::binary);
+    if (!in.is_open())
+    {
+	throw std::runtime_error(Formatter() << "Could not open file " << path << ".");
+    }
+
+    in.ignore(sizeof(dumpMagic));
+    get32(in, path);
+    return get32(in, path);
+}
+
+FlashImage FlashImage::load(const std::string &path)
+{
+    std::ifstream in(path.c_str(), std::ifstream::binary);
+    if (!in.is_open())
+    {
+	throw std::runtime_error(Formatter() << "Could not open file " << path << ".");
+    }
+
+    FlashImage image;
+    if (isDump(path))
+    {
+	image.loadDump(in, path);
+	return image;
+    }
+
+    std::vector<uint8_t> buffer(64 * 1024);
+    while (in)
+    {
+	in.read((char *)buffer.data(), buffer.size());
+	image.append(buffer.data(), in.gcount());
+    }
+    return image;
+}
+
+void FlashImage::loadDump(std::istream &in, const std::string &path)
+{
+    in.ignore(sizeof(dumpMagic));
+
+    uint32_t version = get32(in, path);
+    if (version != dumpVersion)
+    {
+	throw std::runtime_error(Formatter() << "Dump file " << path << " has unsupported version " << version << ".");
+    }
+    m_base = get32(in, path);
+    m_size = get32(in, path);
+    m_fill = get32(in, path);
+
+    uint32_t crc = 0;
+    while (true)
+    {
+	uint32_t offset = get32(in, path);
+	if (offset == dumpEnd)
+	    break;
+
+	uint32_t length = get32(in, path);
+	uint32_t end = m_ranges.empty() ? 0 : m_ranges.back().offset + m_ranges.back().data.size();
+	if (offset < end || length > m_size || offset > m_size - length)
+	{
+	    throw std::runtime_error(Formatter() << "Dump file " << path << " has an invalid record at offset " << offset << ".");
+	}
+
+	Range range;
+	range.offset = offset;
+	range.data.resize(length);
+	if (!in.read((char *)range.data.data(), length))
+	{
+	    throw std::runtime_error(Formatter() << "Dump file " << path << " is truncated.");
+	}
+	crc = crc32(range.data.data(), length, crc);
+	m_ranges.push_back(std::move(range));
+    }
+
+    if (get32(in, path) != crc)
+    {
+	throw std::runtime_error(Formatter() << "Dump file " << path << " is corrupted, CRC mismatch.");
+    }
+}
+
+void FlashImage::append(const uint8_t *data, uint32_t length)
+{
+    for (uint32_t done = 0; done < length; )
+    {
+	uint32_t chunk = std::min(pageSize - m_size % pageSize, length - done);
+
+	if (!isBlank(data + done, chunk, m_fill))
+	{
+	    if (m_ranges.empty() || m_ranges.back().offset + m_ranges.back().data.size() != m_size)
+	    {
+		m_ranges.push_back(Range());
+		m_ranges.back().offset = m_size;
+	    }
+	    std::vector<uint8_t> &range = m_ranges.back().data;
+	    range.insert(range.end(), data + done, data + done + chunk);
+	}
+	m_size += chunk;
+	done += chunk;
+    }
+}
+
+uint32_t FlashImage::dataSize() const
+{
+    uint32_t size = 0;
+    for (auto &range : m_ranges)
+    {
+	size += range.data.size();
+    }
+    return size;
+}
+
+std::vector<uint8_t> FlashImage::flatten() const
+{
+    std::vector<uint8_t> buffer(m_size, m_fill);
+    for (auto &range : m_ranges)
+    {
+	std::copy(range.data.begin(), range.data.end(), buffer.begin() + range.offset);
+    }
+    return buffer;
+}
+
+FlashDumpWriter::FlashDumpWriter(std::ostream &out, uint32_t base, uint32_t size, uint8_t fill) :
+    m_out(out),
+    m_size(size),
+    m_fill(fill)
+{
+    m_out.write(dumpMagic, sizeof(dumpMagic));
+    put32(m_out, dumpVersion);
+    put32(m_out, base);
+    put32(m_out, size);
+    put32(m_out, fill);
+}
+
+void FlashDumpWriter::write(const uint8_t *data, uint32_t length)
+{
+    uint32_t pageSize = FlashImage::pageSize;
+
+    for (uint32_t done = 0; done < length; )
+    {
+	uint32_t chunk = std::min(pageSize - m_offset % pageSize, length - done);
+
+	if (FlashImage::isBlank(data + done, chunk, m_fill))
+	{
+	    flushRun();
+	}
+	else
+	{
+	    if (m_run.empty())
+		m_runOffset = m_offset;
+	    m_run.insert(m_run.end(), data + done, data + done + chunk);
+	    if (m_run.size() >= maxRecordSize)
+		flushRun();
+	}
+	m_offset += chunk;
+	done += chunk;
+    }
+}
+
+void FlashDumpWriter::flushRun()
+{
+    if (m_run.empty())
+	return;
+
+    put32(m_out, m_runOffset);
+    put32(m_out, m_run.size());
+    m_out.write((const char *)m_run.data(), m_run.size());
+
+    m_crc = crc32(m_run.data(), m_run.size(), m_crc);
+    m_dataSize += m_run.size();
+    m_ranges++;
+    m_run.clear();
+}
+
+void FlashDumpWriter::finish()
+{
+    if (m_offset != m_size)
+    {
+	throw std::runtime_error(Formatter() << "Dump ends at " << m_offset << " of " << m_size << " bytes.");
+    }
+
+    flushRun();
+    put32(m_out, dumpEnd);
+    put32(m_out, m_crc);
+    m_out.flush();
+
+    if (!m_out)
+    {
+	throw std::runtime_error("Could not write dump file.");
+    }
+}
@@ -0,0 +1,96 @@
+#ifndef FLASH_IMAGE_H
+#define FLASH_IMAGE_H
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/*
+ * A flash image kept as the list of ranges holding data; everything in
+ * between is erased (fill) flash. Images are read from raw files, where
+ * blank pages are detected on load, or from range-list dumps written by
+ * FlashDumpWriter, so memory use, programming and compare time follow the
+ * occupied data rather than the image size.
+ *
+ * Dump format, all numbers 32-bit little endian:
+ *   "FTDIDUMP", version, base address, image size, fill value
+ *   records of offset, length and length bytes of data, in address order
+ *   0xffffffff and the CRC-32 of all record data
+ */
+class FlashImage
+{
+public:
+    struct Range
+    {
+	uint32_t offset;
+	std::vector<uint8_t> data;
+    };
+
+    // Granularity of blank detection
+    static const uint32_t pageSize = 256;
+
+    explicit FlashImage(uint8_t fill = 0xff);
+
+    // Loads a range-list dump or, failing the dump magic, a raw image
+    static FlashImage load(const std::string &path);
+    static bool isDump(const std::string &path);
+    // Flash address a range-list dump was read from
+    static uint32_t dumpBase(const std::string &path);
+    static bool isBlank(const uint8_t *data, uint32_t length, uint8_t fill);
+
+    // Appends raw image data; blank pages become gaps
+    void append(const uint8_t *data, uint32_t length);
+
+    uint32_t size() const                       { return m_size; }
+    uint32_t dataSize() const;
+    uint32_t base() const                       { return m_base; }
+    uint8_t fill() const                        { return m_fill; }
+    const std::vector<Range> &ranges() const    { return m_ranges; }
+
+    // The image as one contiguous buffer
+    std::vector<uint8_t> flatten() const;
+
+private:
+    uint32_t m_size;
+    uint32_t m_base;
+    uint8_t m_fill;
+    std::vector<Range> m_ranges;
+
+    void loadDump(std::istream &in, const std::string &path);
+};
+
+/*
+ * Writes a range-list dump while the data streams in. Blank pages are dropped
+ * and runs of data pages are written as one record.
+ */
+class FlashDumpWriter
+{
+public:
+    FlashDumpWriter(std::ostream &out, uint32_t base, uint32_t size, uint8_t fill = 0xff);
+
+    // Data must be written in address order and add up to the image size
+    void write(const uint8_t *data, uint32_t length);
+    void finish();
+
+    uint32_t dataSize() const   { return m_dataSize; }
+    uint32_t ranges() const     { return m_ranges; }
+
+private:
+    // Data runs are split into records of at most this size
+    static const uint32_t maxRecordSize = 1024 * 1024;
+
+    std::ostream &m_out;
+    uint32_t m_size;
+    uint8_t m_fill;
+    uint32_t m_offset = 0;
+    uint32_t m_runOffset = 0;
+    std::vector<uint8_t> m_run;
+    uint32_t m_crc = 0;
+    uint32_t m_dataSize = 0;
+    uint32_t m_ranges = 0;
+
+    void flushRun();
+};
+
+#endif // FLASH_IMAGE_H
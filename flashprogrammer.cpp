@@ -0,0 +1,1470 @@
+#include "flashprogrammer.h"
+#include "digest.h"
+#include "chipprofiles.h"
+#include "programstream.h"
+#include "registry.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <random>
+#include <set>
+
+const uint32_t FlashProgrammer::readChunkSize;
+
+// Patches erase 4 kB subsectors; maximum subsector erase time in ms
+static const uint32_t subsectorSize = 4 * 1024;
+static const uint32_t subsectorEraseTime = 400;
+
+// Erase time in ms between a resume and the next suspend, so reads handed
+// over back to back cannot keep the erase from making progress
+static const int eraseResumeTime = 20;
+
+// Streaming reads are handed over to an erasing thread in pieces this large
+static const uint32_t suspendReadSize = 64 * 1024;
+
+static std::mt19937 &randomEngine()
+{
+    static std::mt19937 rng((std::random_device())());
+    return rng;
+}
+
+const std::vector<FlashConfig> &FlashProgrammer::memories()
+{
+    static const std::vector<FlashConfig> memory = []() {
+	std::vector<FlashConfig> configs;
+	for (auto &profile : chipProfiles())
+	{
+	    configs.push_back(profile.config);
+	}
+	for (auto &nand : SpiNand::memories())
+	{
+	    configs.push_back(nand);
+	}
+	return configs;
+    }();
+
+    return memory;
+}
+
+const FlashConfig *FlashProgrammer::findMemory(const std::string &name)
+{
+    for (auto &item : memories())
+    {
+	if (item.memoryName == name)
+	    return &item;
+    }
+    return nullptr;
+}
+
+const FlashConfig *FlashProgrammer::findMemory(const uint8_t jedecId[3])
+{
+    for (auto &item : memories())
+    {
+	if (item.manufacturerId == jedecId[0] &&
+	    item.ID15_ID8 == jedecId[1] &&
+	    item.ID7_ID0 == jedecId[2])
+	{
+	    return &item;
+	}
+    }
+    return nullptr;
+}
+
+FlashProgrammer::FlashProgrammer() :
+    m_eraseSuspend(false)
+{
+}
+
+void FlashProgrammer::open(enum ftdi_interface ifnum, const char *devstr)
+{
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+    m_spi.open(ifnum, devstr);
+}
+
+void FlashProgrammer::open(ftdisink *sink)
+{
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+    m_spi.open(sink);
+}
+
+void FlashProgrammer::setProgressCallback(ProgressCallback callback)
+{
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+    m_progress = callback;
+}
+
+const FlashConfig &FlashProgrammer::config() const
+{
+    if (m_config == nullptr)
+    {
+	throw std::runtime_error("Flash memory has not been identified.");
+    }
+    return *m_config;
+}
+
+uint32_t FlashProgrammer::size() const
+{
+    return m_nand ? m_nand->usableSize() : config().size;
+}
+
+/* Progress of a part of a job that starts offset bytes into it. */
+static std::function<void(uint32_t)> offsetProgress(std::function<void(uint32_t)> progress, uint32_t offset)
+{
+    if (!progress)
+	return nullptr;
+
+    return [progress, offset](uint32_t done) { progress(offset + done); };
+}
+
+FlashProgrammer::StepCallback FlashProgrammer::reporter(const std::string &phase, uint32_t total)
+{
+    ProgressCallback progress = m_progress;
+    if (!progress)
+	return nullptr;
+
+    return [progress, phase, total](uint32_t done) { progress(phase, done, total); };
+}
+
+const FlashConfig *FlashProgrammer::identify()
+{
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+    m_spi.setPhase("Identify");
+
+    ftditransaction identify(m_spi, "Flash Read Id");
+    m_spi.flash_power_up(identify);
+    ftdiresult_ptr id = m_spi.flash_read_id(identify);
+    identify.flush();
+
+    std::memcpy(m_jedecId, id->data().data(), sizeof(m_jedecId));
+    m_config = findMemory(m_jedecId);
+
+    // The compiled command templates assume the pin setup they were built for
+    m_profile = findChipProfile(m_jedecId);
+    if (m_profile != nullptr &&
+	(m_profile->cs_bits != m_spi.getCsBits() || m_profile->pindir != m_spi.getPinDir()))
+    {
+	m_profile = nullptr;
+    }
+
+    // Not a known SPI NOR; SPI NAND answers the same command after a dummy byte
+    m_nand.reset();
+    if (m_config == nullptr)
+    {
+	uint8_t nandId[3];
+	SpiNand::readId(m_spi, nandId);
+
+	if (SpiNand::findMemory(nandId) != nullptr)
+	{
+	    std::memcpy(m_jedecId, nandId, sizeof(m_jedecId));
+	    m_config = findMemory(m_jedecId);
+	    m_nand.reset(new SpiNand(m_spi, *m_config));
+	    m_nand->init();
+	}
+    }
+    return m_config;
+}
+
+std::string FlashProgrammer::uniqueId()
+{
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+
+    if (m_nand)
+    {
+	throw std::runtime_error("Unique IDs are not supported for SPI NAND.");
+    }
+
+    uint8_t id[8];
+    m_spi.flash_read_unique_id(id);
+
+    // Memories without the command leave DO idle
+    if (std::all_of(id, id + 8, [](uint8_t b) { return b == 0xFF; }) ||
+	std::all_of(id, id + 8, [](uint8_t b) { return b == 0x00; }))
+    {
+	throw std::runtime_error("The flash memory has no unique ID.");
+    }
+
+    char hex[17];
+    for (int i = 0; i < 8; i++)
+    {
+	snprintf(hex + 2 * i, 3, "%02x", id[i]);
+    }
+    return hex;
+}
+
+void FlashProgrammer::waitReady()
+{
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+
+    if (m_nand)
+    {
+	m_nand->waitReady();
+	return;
+    }
+    m_spi.flash_wait(100, 1000);
+}
+
+void FlashProgrammer::eraseChip()
+{
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+    m_spi.setPhase("Erase");
+
+    if (m_nand)
+    {
+	m_nand->eraseAll(reporter("Erase", m_nand->usableSize() / m_nand->blockSize()));
+	return;
+    }
+
+    StepCallback progress = reporter("Erase", 1);
+
+    ftditransaction erase(m_spi, "Bulk erase");
+    m_spi.flash_write_enable(erase);
+    m_spi.flash_bulk_erase(erase);
+    waitErase(erase, 1000, 200000, false); // Probe every 1 sec for 200 seconds
+
+    if (progress)
+	progress(1);
+}
+
+void FlashProgrammer::eraseSector(uint32_t sector)
+{
+    ftditransaction erase(m_spi, "Erase 64kB sector");
+    m_spi.flash_write_enable(erase);
+    m_spi.flash_64kB_sector_erase(erase, sector);
+    waitErase(erase, 150, config().blockEraseTime64k, true); // Probe every 150 ms
+}
+
+void FlashProgrammer::setEraseSuspend(bool enable)
+{
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+    m_eraseSuspend = enable;
+}
+
+/* Polls like ftdispi::flash_wait. With erase suspend enabled, the pause
+ * between polls ends early when another thread hands over a read; the reads
+ * are served with the erase suspended and their time does not count against
+ * the erase. After a resume the erase runs for at least eraseResumeTime
+ * before it is suspended again. A chip erase cannot be suspended, so reads
+ * handed over during one wait until it has finished. */
+void FlashProgrammer::waitErase(ftditransaction &erase, int interval, int duration, bool suspendable)
+{
+    if (!m_eraseSuspend)
+    {
+	m_spi.flash_wait(erase, interval, duration);
+	return;
+    }
+
+    {
+	std::lock_guard<std::mutex> lock(m_suspendMutex);
+	m_erasing = true;
+    }
+    m_suspendCond.notify_all();
+
+    std::vector<SuspendRead *> reads;
+    try
+    {
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(duration);
+	auto resumable = std::chrono::steady_clock::now();
+	while (1)
+	{
+	    ftdiresult_ptr status = m_spi.flash_read_status(erase);
+	    erase.flush();
+
+	    if (((*status)[0] & 0x01) == 0)
+		break;
+
+	    if (std::chrono::steady_clock::now() > deadline)
+	    {
+		throw std::runtime_error(Formatter() << "Waiting too long for flash memory to be ready.");
+	    }
+
+	    std::unique_lock<std::mutex> lock(m_suspendMutex);
+	    auto wake = std::chrono::steady_clock::now() + std::chrono::milliseconds(interval);
+	    if (std::chrono::steady_clock::now() < resumable)
+		m_suspendCond.wait_until(lock, std::min(wake, resumable), []() { return false; });
+	    else
+		m_suspendCond.wait_until(lock, wake,
+		    [this, suspendable]() { return suspendable && !m_suspendReads.empty(); });
+	    if (suspendable && std::chrono::steady_clock::now() >= resumable)
+		reads.swap(m_suspendReads);
+	    lock.unlock();
+
+	    if (!reads.empty())
+	    {
+		auto begin = std::chrono::steady_clock::now();
+		serveReads(reads, true);
+		deadline += std::chrono::steady_clock::now() - begin;
+		resumable = std::chrono::steady_clock::now() + std::chrono::milliseconds(eraseResumeTime);
+	    }
+	}
+    }
+    catch (std::exception &)
+    {
+	std::lock_guard<std::mutex> lock(m_suspendMutex);
+	m_erasing = false;
+	for (auto read : m_suspendReads)
+	{
+	    read->error = std::current_exception();
+	    read->done = true;
+	}
+	m_suspendReads.clear();
+	m_suspendCond.notify_all();
+	throw;
+    }
+
+    // Reads handed over after the last poll need no suspend any more
+    std::unique_lock<std::mutex> lock(m_suspendMutex);
+    m_erasing = false;
+    reads.swap(m_suspendReads);
+    lock.unlock();
+    serveReads(reads, false);
+}
+
+/* Returns false if the erase finished before it could be suspended. */
+bool FlashProgrammer::suspendErase()
+{
+    ftditransaction suspend(m_spi, "Erase suspend");
+    m_spi.flash_suspend(suspend);
+
+    for (int i = 0; i < 10; i++)
+    {
+	ftdiresult_ptr status = m_spi.flash_read_status(suspend);
+	ftdiresult_ptr status2 = m_spi.flash_read_status2(suspend);
+	suspend.flush();
+
+	if (((*status)[0] & 0x01) == 0)
+	    return ((*status2)[0] & 0x80) != 0;
+    }
+    throw std::runtime_error("Flash memory did not suspend the erase.");
+}
+
+/* Runs the reads handed over by other threads and wakes them. With suspend
+ * set, the erase in progress is suspended around them. */
+void FlashProgrammer::serveReads(std::vector<SuspendRead *> &reads, bool suspend)
+{
+    std::exception_ptr error;
+    size_t served = 0;
+    try
+    {
+	bool suspended = suspend && suspendErase();
+
+	for (; served < reads.size(); served++)
+	{
+	    SuspendRead *read = reads[served];
+	    try
+	    {
+		for (uint32_t done = 0; done < read->length; )
+		{
+		    uint32_t sizeToRead = std::min(readChunkSize, read->length - done);
+		    flashRead(read->addr + done, read->data + done, sizeToRead);
+		    done += sizeToRead;
+		}
+	    }
+	    catch (std::exception &)
+	    {
+		read->error = std::current_exception();
+	    }
+	}
+
+	if (suspended)
+	{
+	    ftditransaction resume(m_spi, "Erase resume");
+	    m_spi.flash_resume(resume);
+	    resume.flush();
+	}
+    }
+    catch (std::exception &)
+    {
+	error = std::current_exception();
+    }
+
+    {
+	std::lock_guard<std::mutex> lock(m_suspendMutex);
+	for (size_t i = 0; i < reads.size(); i++)
+	{
+	    if (i >= served)
+		reads[i]->error = error;
+	    reads[i]->done = true;
+	}
+    }
+    m_suspendCond.notify_all();
+    reads.clear();
+
+    if (error)
+	std::rethrow_exception(error);
+}
+
+/* Takes the job lock for read(). While another thread waits for an erase,
+ * the read is handed to that thread instead; returns true once it has been
+ * served that way. */
+bool FlashProgrammer::readDuringErase(std::unique_lock<std::recursive_mutex> &lock, uint32_t addr, uint8_t *data,
+    uint32_t length)
+{
+    std::unique_lock<std::mutex> suspendLock(m_suspendMutex);
+    while (!lock.try_lock())
+    {
+	if (m_erasing)
+	{
+	    SuspendRead read = { addr, data, length, false, nullptr };
+	    m_suspendReads.push_back(&read);
+	    m_suspendCond.notify_all();
+	    m_suspendCond.wait(suspendLock, [&read]() { return read.done; });
+
+	    if (read.error)
+		std::rethrow_exception(read.error);
+	    return true;
+	}
+
+	// Woken as soon as an erase starts; other jobs are waited for in steps
+	m_suspendCond.wait_for(suspendLock, std::chrono::milliseconds(1));
+    }
+    return false;
+}
+
+/* Erases the aligned 64 kB sectors covering the range. */
+void FlashProgrammer::eraseSectors(uint32_t addr, uint32_t length)
+{
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+    m_spi.setPhase("Erase");
+
+    if (m_nand)
+    {
+	uint32_t blockSize = m_nand->blockSize();
+	uint32_t blocks = (addr + length + blockSize - 1) / blockSize - addr / blockSize;
+	m_nand->erase(addr, length, reporter("Erase", blocks * blockSize));
+	return;
+    }
+
+    uint32_t begin_addr = addr & ~0xffff;
+    uint32_t end_addr = (addr + length + 0xffff) & ~0xffff;
+
+    StepCallback progress = reporter("Erase", end_addr - begin_addr);
+
+    for (uint32_t sector = begin_addr; sector < end_addr; sector += 0x10000)
+    {
+	eraseSector(sector);
+
+	if (progress)
+	    progress(sector + 0x10000 - begin_addr);
+    }
+}
+
+/* Pages are queued into bulks of about 64 kB of MPSSE commands, each handed to
+ * emit with the number of bytes it completes. Runs of whole pages use the chip
+ * profile's precomputed command headers; partial pages go through ftdispi. */
+void FlashProgrammer::buildBulks(uint32_t addr, const uint8_t *data, uint32_t length, BulkCallback emit)
+{
+    const uint32_t bulkSize = 64 * 1024;
+
+    ftditransaction bulk(m_spi, "Send bulk data");
+    uint32_t pageProgramTime = config().pageProgramTime;
+    uint32_t pageSize = m_profile ? m_profile->pageSize : 256;
+    uint32_t idleBytes = m_spi.idle_bytes(pageProgramTime);
+
+    uint32_t done = 0;
+    while (done < length)
+    {
+	while (bulk.size() < bulkSize && done < length)
+	{
+	    uint32_t page_offset = (addr + done) % pageSize;
+	    uint32_t pages = (length - done) / pageSize;
+
+	    if (m_profile != nullptr && page_offset == 0 && pages > 0)
+	    {
+		pages = std::min<uint32_t>(pages, (bulkSize - bulk.size()) / m_profile->programPageBytes + 1);
+		m_profile->programPages(bulk, addr + done, data + done, pages, idleBytes);
+		done += pages * pageSize;
+		continue;
+	    }
+
+	    uint32_t page_size = pageSize - page_offset;
+	    if (page_size > length - done)
+		page_size = length - done;
+
+	    m_spi.prepare_flash_prog(bulk, addr + done, data + done, page_size, pageProgramTime);
+	    done += page_size;
+	}
+
+	emit(bulk, done);
+    }
+}
+
+/* Sends each bulk together with a status poll. */
+void FlashProgrammer::programRange(uint32_t addr, const uint8_t *data, uint32_t length, StepCallback progress)
+{
+    buildBulks(addr, data, length, [this, progress](ftditransaction &bulk, uint32_t done) {
+	m_spi.flash_wait(bulk, 50, 100);
+
+	if (progress)
+	    progress(done);
+    });
+}
+
+/* Builds the page program commands of the image for the identified memory,
+ * without sending them. */
+FlashProgrammer::ProgramBulks FlashProgrammer::buildProgram(uint32_t addr, const FlashImage &image)
+{
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+
+    if (m_nand)
+    {
+	throw std::runtime_error("Prebuilt program bulks are not supported for SPI NAND.");
+    }
+
+    ProgramBulks program;
+    std::memcpy(program.jedecId, m_jedecId, sizeof(program.jedecId));
+    program.divisor = m_spi.getDivisor();
+
+    uint32_t programmed = 0;
+    for (auto &range : image.ranges())
+    {
+	buildBulks(addr + range.offset, range.data.data(), range.data.size(),
+	    [&program, programmed](ftditransaction &bulk, uint32_t done) {
+		program.bulks.push_back(bulk.commands());
+		program.done.push_back(programmed + done);
+		bulk.clear();
+	    });
+	programmed += range.data.size();
+    }
+    return program;
+}
+
+/* Sends bulks built by buildProgram(), which must match the memory and clock. */
+void FlashProgrammer::program(const ProgramBulks &program)
+{
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+    m_spi.setPhase("Program");
+
+    if (std::memcmp(program.jedecId, m_jedecId, sizeof(m_jedecId)) != 0 || program.divisor != m_spi.getDivisor())
+    {
+	throw std::runtime_error("Program bulks were built for a different memory or SPI clock.");
+    }
+
+    StepCallback progress = reporter("Program", program.done.empty() ? 0 : program.done.back());
+
+    ftditransaction bulk(m_spi, "Send bulk data");
+    for (size_t i = 0; i < program.bulks.size(); i++)
+    {
+	const std::vector<uint8_t> &commands = program.bulks[i];
+	std::memcpy(bulk.reserve(commands.size()), commands.data(), commands.size());
+	m_spi.flash_wait(bulk, 50, 100);
+
+	if (progress)
+	    progress(program.done[i]);
+    }
+}
+
+/* Sends the bulks of a compiled stream straight from the mapped file. Each
+ * bulk ends with a status read, so a bulk costs one write and one read. */
+/* The bulks hold raw MPSSE commands, so the memory, the clock divisor and
+ * the pin setup must all be the ones the stream was compiled for. */
+void FlashProgrammer::checkStream(const ProgramStream &stream)
+{
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+
+    if (m_nand || std::memcmp(stream.jedecId(), m_jedecId, sizeof(m_jedecId)) != 0)
+    {
+	char jedecId[8];
+	snprintf(jedecId, sizeof(jedecId), "%02x%02x%02x", stream.jedecId()[0], stream.jedecId()[1], stream.jedecId()[2]);
+	throw std::runtime_error(Formatter() << "Stream was compiled for a different memory, JEDEC ID " << jedecId << ".");
+    }
+    if (stream.divisor() != m_spi.getDivisor())
+    {
+	throw std::runtime_error(Formatter() << "Stream was compiled for clock divisor " << stream.divisor() <<
+	    ", the programmer uses " << m_spi.getDivisor() << ".");
+    }
+    if (stream.csBits() != m_spi.getCsBits() || stream.pinDir() != m_spi.getPinDir())
+    {
+	throw std::runtime_error("Stream was compiled for a different pin setup.");
+    }
+}
+
+void FlashProgrammer::program(const ProgramStream &stream)
+{
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+    m_spi.setPhase("Program");
+
+    checkStream(stream);
+
+    StepCallback progress = reporter("Program", stream.bulks() ? stream.bulkDone(stream.bulks() - 1) : 0);
+
+    for (size_t i = 0; i < stream.bulks(); i++)
+    {
+	uint8_t status;
+	m_spi.write(const_cast<uint8_t *>(stream.bulk(i)), stream.bulkSize(i), "Send bulk data");
+	m_spi.read(&status, 1, "Send bulk data");
+	if (status & 0x01)
+	    m_spi.flash_wait(50, 100);
+
+	if (progress)
+	    progress(stream.bulkDone(i));
+    }
+}
+
+/* Reads the image range back and compares each sector with the stream's
+ * digests as soon as it is complete. */
+void FlashProgrammer::verify(const ProgramStream &stream)
+{
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+    m_spi.setPhase("Verify");
+
+    checkStream(stream);
+
+    StepCallback progress = reporter("Verify", stream.size());
+    FlashDigest digest(stream.base(), stream.sectorSize());
+    size_t checked = 0;
+
+    auto check = [&stream, &digest, &checked]() {
+	for (; checked < digest.sectors().size(); checked++)
+	{
+	    const FlashDigest::Entry &expected = stream.sectors().at(checked);
+	    const FlashDigest::Entry &actual = digest.sectors()[checked];
+	    if (actual.crc != expected.crc || actual.sha256 != expected.sha256)
+	    {
+		throw std::runtime_error(Formatter() << "Found difference between flash and stream in sector at address " <<
+		    expected.addr << "!");
+	    }
+	}
+    };
+
+    for (uint32_t done = 0; done < stream.size(); )
+    {
+	uint32_t sizeToRead = std::min(readChunkSize, stream.size() - done);
+
+	ftdiresult_ptr chunk = flashRead(stream.base() + done, sizeToRead);
+	digest.update(chunk->data().data(), sizeToRead);
+	check();
+	done += sizeToRead;
+
+	if (progress)
+	    progress(done);
+    }
+    digest.final();
+    check();
+
+    if (digest.range().sha256 != stream.range().sha256)
+    {
+	throw std::runtime_error("Found difference between flash and stream!");
+    }
+}
+
+void FlashProgrammer::setCheckedReads(uint32_t fastDivisor)
+{
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+
+    if (fastDivisor != 0)
+	ftdispi::check_divisor(fastDivisor);
+    m_fastDivisor = fastDivisor;
+    m_readStats = ReadStats();
+}
+
+/* Both fast copies go out in one transaction that switches the clock back
+ * at its end; a sampled chunk gets its normal clock copy in the same
+ * transaction. A chunk whose copies differ is read at the normal clock until
+ * a read matches one of the copies seen so far. */
+ftdiresult_ptr FlashProgrammer::checkedRead(uint32_t addr, uint32_t length)
+{
+    const int maxSlowReads = 4;
+    const uint32_t confirmInterval = 64;
+
+    bool confirm = m_readStats.chunks % confirmInterval == 0;
+
+    ftditransaction t(m_spi, "Checked read");
+    m_spi.set_clock_divisor(t, m_fastDivisor);
+    ftdiresult_ptr first = m_profile ? m_profile->read(t, addr, length) : m_spi.flash_read(t, addr, length);
+    ftdiresult_ptr second = m_profile ? m_profile->read(t, addr, length) : m_spi.flash_read(t, addr, length);
+    m_spi.set_clock_divisor(t, m_spi.getDivisor());
+    ftdiresult_ptr reference;
+    if (confirm)
+	reference = m_profile ? m_profile->read(t, addr, length) : m_spi.flash_read(t, addr, length);
+    t.flush();
+
+    m_readStats.chunks++;
+    if (confirm)
+    {
+	m_readStats.confirmed++;
+	if (first->data() != reference->data() && second->data() != reference->data())
+	{
+	    // Fast copies that agree on wrong data cannot be told from good ones
+	    m_readStats.fastFailed = true;
+	    m_fastDivisor = 0;
+	    return flashRead(addr, length);
+	}
+    }
+
+    if (first->data() == second->data())
+	return first;
+
+    m_readStats.fallbacks++;
+    std::vector<ftdiresult_ptr> copies = { first, second };
+    for (int i = 0; i < maxSlowReads; i++)
+    {
+	m_readStats.slowReads++;
+	ftdiresult_ptr slow = m_profile ? m_profile->read(t, addr, length) : m_spi.flash_read(t, addr, length);
+	t.flush();
+
+	for (auto &copy : copies)
+	{
+	    if (copy->data() == slow->data())
+		return slow;
+	}
+	copies.push_back(slow);
+    }
+    throw std::runtime_error(Formatter() << "Reads from address " << addr << " do not agree even at the normal SPI clock.");
+}
+
+ftdiresult_ptr FlashProgrammer::flashRead(uint32_t addr, uint32_t length)
+{
+    if (m_fastDivisor != 0)
+	return checkedRead(addr, length);
+
+    ftditransaction t(m_spi, "Flash read");
+    ftdiresult_ptr result = m_profile ? m_profile->read(t, addr, length) : m_spi.flash_read(t, addr, length);
+    t.flush();
+
+    return result;
+}
+
+void FlashProgrammer::flashRead(uint32_t addr, uint8_t *data, uint32_t length)
+{
+    std::memcpy(data, flashRead(addr, length)->data().data(), length);
+}
+
+void FlashProgrammer::program(uint32_t addr, const uint8_t *data, uint32_t length)
+{
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+    m_spi.setPhase("Program");
+
+    if (m_nand)
+    {
+	FlashImage image;
+	image.append(data, length);
+	m_nand->program(addr, image, reporter("Program", image.dataSize()));
+	return;
+    }
+
+    programRange(addr, data, length, reporter("Program", length));
+}
+
+void FlashProgrammer::read(uint32_t addr, uint8_t *data, uint32_t length)
+{
+    std::unique_lock<std::recursive_mutex> lock(m_mutex, std::defer_lock);
+    if (!m_eraseSuspend)
+	lock.lock();
+    else if (readDuringErase(lock, addr, data, length))
+	return;
+    m_spi.setPhase("Read");
+
+    StepCallback progress = reporter("Read", length);
+
+    if (m_nand)
+    {
+	uint8_t *out = data;
+	m_nand->read(addr, length, [&out](const uint8_t *chunk, uint32_t size) {
+	    std::memcpy(out, chunk, size);
+	    out += size;
+	}, progress);
+	return;
+    }
+
+    for (uint32_t done = 0; done < length; )
+    {
+	uint32_t sizeToRead = std::min(readChunkSize, length - done);
+
+	flashRead(addr + done, data + done, sizeToRead);
+	done += sizeToRead;
+
+	if (progress)
+	    progress(done);
+    }
+}
+
+/* Programs the data ranges of the image; the gaps are left erased. */
+void FlashProgrammer::program(uint32_t addr, const FlashImage &image)
+{
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+    m_spi.setPhase("Program");
+
+    StepCallback progress = reporter("Program", image.dataSize());
+
+    if (m_nand)
+    {
+	m_nand->program(addr, image, progress);
+	return;
+    }
+
+    uint32_t programmed = 0;
+    for (auto &range : image.ranges())
+    {
+	programRange(addr + range.offset, range.data.data(), range.data.size(), offsetProgress(progress, programmed));
+	programmed += range.data.size();
+    }
+}
+
+/* Reads the range chunk by chunk, handing each chunk to the consumer straight
+ * from the USB receive buffer as soon as it arrives. While another thread
+ * waits for an erase, the range is handed over to it piece by piece instead;
+ * whatever is left once the job lock is free streams as usual. */
+void FlashProgrammer::read(uint32_t addr, uint32_t length, DataCallback consumer)
+{
+    std::unique_lock<std::recursive_mutex> lock(m_mutex, std::defer_lock);
+    uint32_t done = 0;
+    if (!m_eraseSuspend)
+	lock.lock();
+    else
+    {
+	std::vector<uint8_t> piece(std::min(suspendReadSize, length));
+	while (done < length)
+	{
+	    uint32_t sizeToRead = std::min(suspendReadSize, length - done);
+	    if (!readDuringErase(lock, addr + done, piece.data(), sizeToRead))
+		break;
+	    consumer(piece.data(), sizeToRead);
+	    done += sizeToRead;
+	}
+	if (done == length)
+	    return;
+    }
+    m_spi.setPhase("Read");
+
+    StepCallback progress = reporter("Read", length);
+
+    if (m_nand)
+    {
+	m_nand->read(addr + done, length - done, consumer, offsetProgress(progress, done));
+	return;
+    }
+
+    while (done < length)
+    {
+	uint32_t sizeToRead = std::min(readChunkSize, length - done);
+
+	ftdiresult_ptr chunk = flashRead(addr + done, sizeToRead);
+	consumer(chunk->data().data(), sizeToRead);
+	done += sizeToRead;
+
+	if (progress)
+	    progress(done);
+    }
+}
+
+/* Reads the range back and throws on the first difference. */
+void FlashProgrammer::verifyRange(uint32_t addr, const uint8_t *data, uint32_t length, StepCallback progress)
+{
+    uint8_t buffer_flash[readChunkSize];
+
+    for (uint32_t done = 0; done < length; )
+    {
+	uint32_t sizeToRead = std::min(readChunkSize, length - done);
+
+	flashRead(addr + done, buffer_flash, sizeToRead);
+	if (memcmp(data + done, buffer_flash, sizeToRead) != 0)
+	{
+	    throw std::runtime_error(Formatter() << "Found difference between flash and file at address " << addr + done << "!");
+	}
+	done += sizeToRead;
+
+	if (progress)
+	    progress(done);
+    }
+}
+
+void FlashProgrammer::verify(uint32_t addr, const uint8_t *data, uint32_t length)
+{
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+    m_spi.setPhase("Verify");
+
+    if (m_nand)
+    {
+	FlashImage image;
+	image.append(data, length);
+	verifyNand(addr, image, reporter("Verify", length));
+	return;
+    }
+
+    verifyRange(addr, data, length, reporter("Verify", length));
+}
+
+/* Reads the range back and throws unless it holds only the fill value. */
+void FlashProgrammer::verifyFill(uint32_t addr, uint32_t length, uint8_t fill, StepCallback progress)
+{
+    uint8_t buffer_flash[readChunkSize];
+
+    for (uint32_t done = 0; done < length; )
+    {
+	uint32_t sizeToRead = std::min(readChunkSize, length - done);
+
+	flashRead(addr + done, buffer_flash, sizeToRead);
+	if (!FlashImage::isBlank(buffer_flash, sizeToRead, fill))
+	{
+	    throw std::runtime_error(Formatter() << "Found difference between flash and file at address " << addr + done << "!");
+	}
+	done += sizeToRead;
+
+	if (progress)
+	    progress(done);
+    }
+}
+
+/* Verifies the data ranges of the image and that the gaps between them are
+ * erased. */
+void FlashProgrammer::verify(uint32_t addr, const FlashImage &image)
+{
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+    m_spi.setPhase("Verify");
+
+    StepCallback progress = reporter("Verify", image.size());
+
+    if (m_nand)
+    {
+	verifyNand(addr, image, progress);
+	return;
+    }
+
+    uint32_t offset = 0;
+    for (auto &range : image.ranges())
+    {
+	if (range.offset > offset)
+	{
+	    verifyFill(addr + offset, range.offset - offset, image.fill(), offsetProgress(progress, offset));
+	}
+	verifyRange(addr + range.offset, range.data.data(), range.data.size(), offsetProgress(progress, range.offset));
+	offset = range.offset + range.data.size();
+    }
+
+    if (offset < image.size())
+    {
+	verifyFill(addr + offset, image.size() - offset, image.fill(), offsetProgress(progress, offset));
+    }
+}
+
+/* Streams the range through the SPI NAND backend and compares each chunk with
+ * the image, its ranges laid over the fill value. */
+void FlashProgrammer::verifyNand(uint32_t addr, const FlashImage &image, StepCallback progress)
+{
+    const std::vector<FlashImage::Range> &ranges = image.ranges();
+    std::vector<uint8_t> expected;
+    size_t first = 0;
+    uint32_t offset = 0;
+
+    m_nand->read(addr, image.size(), [&](const uint8_t *data, uint32_t length) {
+	expected.assign(length, image.fill());
+	for (size_t i = first; i < ranges.size() && ranges[i].offset < offset + length; i++)
+	{
+	    uint32_t begin = std::max(ranges[i].offset, offset);
+	    uint32_t end = std::min<uint32_t>(ranges[i].offset + ranges[i].data.size(), offset + length);
+	    if (begin < end)
+		std::memcpy(&expected[begin - offset], &ranges[i].data[begin - ranges[i].offset], end - begin);
+	    else
+		first = i + 1;
+	}
+
+	if (memcmp(data, expected.data(), length) != 0)
+	{
+	    throw std::runtime_error(Formatter() << "Found difference between flash and file at address " << addr + offset << "!");
+	}
+	offset += length;
+    }, progress);
+}
+
+/* Quick check that a sector recorded as verified still holds the image: the
+ * first page and one randomly chosen page are read back and compared. */
+bool FlashProgrammer::spotCheck(uint32_t addr, const uint8_t *data, uint32_t length)
+{
+    uint32_t pages[] = { 0, (uint32_t)(randomEngine()() % ((length + 255) / 256)) * 256 };
+    for (auto page : pages)
+    {
+	uint8_t buffer_flash[256];
+	uint32_t sizeToRead = std::min<uint32_t>(256, length - page);
+
+	flashRead(addr + page, buffer_flash, sizeToRead);
+	if (crc32(buffer_flash, sizeToRead) != crc32(data + page, sizeToRead))
+	    return false;
+    }
+    return true;
+}
+
+/* Splits the bytes into runs of consecutive addresses, none crossing a page. */
+static std::vector<FlashProgrammer::PatchEdit> pageRuns(const std::map<uint32_t, uint8_t> &bytes, uint32_t pageSize)
+{
+    std::vector<FlashProgrammer::PatchEdit> runs;
+    for (auto &byte : bytes)
+    {
+	if (runs.empty() || runs.back().addr + runs.back().data.size() != byte.first || byte.first % pageSize == 0)
+	    runs.push_back(FlashProgrammer::PatchEdit{ byte.first, { } });
+	runs.back().data.push_back(byte.second);
+    }
+    return runs;
+}
+
+/* Fills each range with the flash contents, sending as many reads per USB
+ * round trip as fit in one read chunk. */
+void FlashProgrammer::readRanges(std::vector<PatchEdit> &ranges)
+{
+    for (size_t first = 0; first < ranges.size(); )
+    {
+	ftditransaction t(m_spi, "Flash read");
+	std::vector<ftdiresult_ptr> results;
+	uint32_t queued = 0;
+
+	while (first + results.size() < ranges.size() &&
+	    (results.empty() || queued + ranges[first + results.size()].data.size() <= readChunkSize))
+	{
+	    PatchEdit &range = ranges[first + results.size()];
+	    results.push_back(m_profile ? m_profile->read(t, range.addr, range.data.size()) :
+		m_spi.flash_read(t, range.addr, range.data.size()));
+	    queued += range.data.size();
+	}
+	t.flush();
+
+	for (auto &result : results)
+	{
+	    std::memcpy(ranges[first].data.data(), result->data().data(), ranges[first].data.size());
+	    first++;
+	}
+    }
+}
+
+/* Applies small edits with as little flash work as possible. Where the flash
+ * only needs bits cleared, the edited bytes are programmed in place; a 4 kB
+ * subsector with any bit to set is read, erased and written back with the
+ * edits applied, skipping its blank pages. Nothing else is touched. */
+FlashProgrammer::PatchResult FlashProgrammer::patch(const std::vector<PatchEdit> &edits)
+{
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+
+    if (m_nand)
+    {
+	throw std::runtime_error("Patching is not supported for SPI NAND.");
+    }
+
+    uint32_t pageSize = m_profile ? m_profile->pageSize : 256;
+    uint32_t pageProgramTime = config().pageProgramTime;
+    PatchResult result = { };
+
+    // Later edits override earlier ones byte by byte
+    std::map<uint32_t, uint8_t> wanted;
+    for (auto &edit : edits)
+    {
+	if ((uint64_t)edit.addr + edit.data.size() > config().size)
+	{
+	    throw std::runtime_error(Formatter() << "Patch at address " << edit.addr << " runs past the end of the flash.");
+	}
+	for (size_t i = 0; i < edit.data.size(); i++)
+	    wanted[edit.addr + i] = edit.data[i];
+    }
+
+    m_spi.setPhase("Read");
+    std::vector<PatchEdit> runs = pageRuns(wanted, pageSize);
+    std::vector<PatchEdit> current = runs;
+    readRanges(current);
+
+    // A 1 bit where the flash holds a 0 can only come from an erase
+    std::map<uint32_t, uint8_t> present;
+    std::set<uint32_t> rewrite;
+    for (size_t i = 0; i < runs.size(); i++)
+    {
+	for (size_t k = 0; k < runs[i].data.size(); k++)
+	{
+	    present[runs[i].addr + k] = current[i].data[k];
+	    if ((current[i].data[k] & runs[i].data[k]) != runs[i].data[k])
+		rewrite.insert((runs[i].addr + k) & ~(subsectorSize - 1));
+	}
+    }
+
+    for (auto &edit : edits)
+    {
+	bool changed = false;
+	bool erased = false;
+	for (uint32_t addr = edit.addr; addr < edit.addr + edit.data.size(); addr++)
+	{
+	    changed |= present[addr] != wanted[addr];
+	    erased |= rewrite.count(addr & ~(subsectorSize - 1)) != 0;
+	}
+
+	if (!changed)
+	    result.unchanged++;
+	else if (erased)
+	    result.rewritten++;
+	else
+	    result.direct++;
+    }
+
+    std::vector<PatchEdit> subsectors;
+    for (uint32_t addr : rewrite)
+    {
+	subsectors.push_back(PatchEdit{ addr, std::vector<uint8_t>(subsectorSize) });
+    }
+    readRanges(subsectors);
+
+    m_spi.setPhase("Program");
+    ftditransaction bulk(m_spi, "Patch");
+
+    for (size_t i = 0; i < runs.size(); i++)
+    {
+	if (runs[i].data == current[i].data || rewrite.count(runs[i].addr & ~(subsectorSize - 1)) != 0)
+	    continue;
+
+	m_spi.prepare_flash_prog(bulk, runs[i].addr, runs[i].data.data(), runs[i].data.size(), pageProgramTime);
+	result.pagePrograms++;
+    }
+
+    for (auto &subsector : subsectors)
+    {
+	auto end = wanted.lower_bound(subsector.addr + subsectorSize);
+	for (auto byte = wanted.lower_bound(subsector.addr); byte != end; ++byte)
+	    subsector.data[byte->first - subsector.addr] = byte->second;
+
+	m_spi.flash_write_enable(bulk);
+	m_spi.flash_4kB_subsector_erase(bulk, subsector.addr);
+	m_spi.flash_wait(bulk, 5, subsectorEraseTime);
+
+	for (uint32_t page = 0; page < subsectorSize; page += pageSize)
+	{
+	    if (FlashImage::isBlank(&subsector.data[page], pageSize, 0xFF))
+		continue;
+
+	    m_spi.prepare_flash_prog(bulk, subsector.addr + page, &subsector.data[page], pageSize, pageProgramTime);
+	    result.pagePrograms++;
+	}
+    }
+    m_spi.flash_wait(bulk, 1, 100);
+    result.subsectors = subsectors.size();
+
+    // Rewritten subsectors are checked whole, the other edits byte by byte
+    m_spi.setPhase("Verify");
+    std::vector<PatchEdit> expected = subsectors;
+    for (auto &run : runs)
+    {
+	if (rewrite.count(run.addr & ~(subsectorSize - 1)) == 0)
+	    expected.push_back(run);
+    }
+    std::vector<PatchEdit> readBack = expected;
+    readRanges(readBack);
+
+    for (size_t i = 0; i < expected.size(); i++)
+    {
+	if (readBack[i].data != expected[i].data)
+	{
+	    throw std::runtime_error(Formatter() << "Found difference between flash and patch at address " << expected[i].addr << "!");
+	}
+    }
+    return result;
+}
+
+/* Rewrites only the 64 kB sectors in which the image differs from the previous
+ * one, which the flash is known to hold. Where one image is longer, the other
+ * counts as erased. Returns the number of sectors rewritten. */
+uint32_t FlashProgrammer::programChanges(uint32_t addr, const FlashImage &image, const FlashImage &previous)
+{
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+
+    if (m_nand)
+    {
+	throw std::runtime_error("Incremental programming is not supported for SPI NAND.");
+    }
+
+    uint32_t length = std::max(image.size(), previous.size());
+    std::vector<uint8_t> data = image.flatten();
+    std::vector<uint8_t> old = previous.flatten();
+    data.resize(length, image.fill());
+    old.resize(length, previous.fill());
+
+    std::vector<uint32_t> changed;
+    for (uint32_t sector = addr & ~0xffff; sector < addr + length; sector += 0x10000)
+    {
+	uint32_t first = std::max(sector, addr) - addr;
+	uint32_t last = std::min(sector + 0x10000, addr + length) - addr;
+	if (memcmp(&data[first], &old[first], last - first) != 0)
+	    changed.push_back(sector);
+    }
+
+    m_spi.setPhase("Erase");
+    StepCallback progress = reporter("Erase", changed.size() * 0x10000);
+    for (size_t i = 0; i < changed.size(); i++)
+    {
+	eraseSector(changed[i]);
+
+	if (progress)
+	    progress((i + 1) * 0x10000);
+    }
+
+    // Blank pages of a changed sector stay erased
+    m_spi.setPhase("Program");
+    progress = reporter("Program", changed.size() * 0x10000);
+    for (size_t i = 0; i < changed.size(); i++)
+    {
+	uint32_t first = std::max(changed[i], addr) - addr;
+	uint32_t last = std::min(changed[i] + 0x10000, addr + length) - addr;
+
+	FlashImage sector(image.fill());
+	sector.append(&data[first], last - first);
+	for (auto &range : sector.ranges())
+	    programRange(addr + first + range.offset, range.data.data(), range.data.size(), nullptr);
+
+	if (progress)
+	    progress((i + 1) * 0x10000);
+    }
+
+    m_spi.setPhase("Verify");
+    progress = reporter("Verify", changed.size() * 0x10000);
+    for (size_t i = 0; i < changed.size(); i++)
+    {
+	uint32_t first = std::max(changed[i], addr) - addr;
+	uint32_t last = std::min(changed[i] + 0x10000, addr + length) - addr;
+	verifyRange(addr + first, &data[first], last - first, nullptr);
+
+	if (progress)
+	    progress((i + 1) * 0x10000);
+    }
+    return changed.size();
+}
+
+/* Erases, programs and verifies the image one 64 kB sector at a time, recording
+ * each step in the journal. Sectors the journal already has as verified are only
+ * spot checked. Returns the number of sectors skipped that way. */
+uint32_t FlashProgrammer::programResumable(ProgressJournal &journal, uint32_t addr, const uint8_t *data, uint32_t length, bool erase)
+{
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+
+    if (m_nand)
+    {
+	throw std::runtime_error("Resumable programming is not supported for SPI NAND.");
+    }
+
+    uint32_t begin_addr = addr & ~0xffff;
+    uint32_t end_addr = (addr + length + 0xffff) & ~0xffff;
+    uint32_t skipped = 0;
+
+    StepCallback progress = reporter("Program", end_addr - begin_addr);
+
+    for (uint32_t sector = begin_addr; sector < end_addr; sector += 0x10000)
+    {
+	// Part of the image that falls into this sector
+	uint32_t first = std::max(sector, addr);
+	uint32_t last = std::min(sector + 0x10000, addr + length);
+	const uint8_t *sector_data = data + (first - addr);
+	uint32_t crc = crc32(sector_data, last - first);
+
+	uint32_t journal_crc = 0;
+	bool recorded = journal.verified(sector, journal_crc);
+	m_spi.setPhase("Verify");
+	if (recorded && journal_crc == crc && spotCheck(first, sector_data, last - first))
+	{
+	    skipped++;
+	}
+	else
+	{
+	    if (erase && (recorded || !journal.erased(sector)))
+	    {
+		m_spi.setPhase("Erase");
+		eraseSector(sector);
+		journal.markErased(sector);
+	    }
+
+	    m_spi.setPhase("Program");
+	    programRange(first, sector_data, last - first, nullptr);
+	    m_spi.setPhase("Verify");
+	    verifyRange(first, sector_data, last - first, nullptr);
+	    journal.markVerified(sector, crc);
+	}
+
+	if (progress)
+	    progress(sector + 0x10000 - begin_addr);
+    }
+    return skipped;
+}
+
+/* Sectors are planned whole: the image with the rest of the sector erased.
+ * Those whose planned SHA-256 matches the registry record for this chip are
+ * skipped; a random sample of them is spot checked first, and if one does
+ * not match, the records of the chip are dropped and every sector rewritten.
+ * Each rewritten sector is forgotten before its erase and recorded once it
+ * has been verified. */
+FlashProgrammer::DeltaResult FlashProgrammer::programDelta(BoardRegistry &registry, uint32_t addr,
+    const FlashImage &image, uint32_t spotChecks)
+{
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+
+    if (m_nand)
+    {
+	throw std::runtime_error("Delta programming is not supported for SPI NAND.");
+    }
+
+    char jedecId[8];
+    snprintf(jedecId, sizeof(jedecId), "%02x%02x%02x", m_jedecId[0], m_jedecId[1], m_jedecId[2]);
+    std::string board = std::string(jedecId) + "-" + uniqueId();
+
+    uint32_t begin_addr = addr & ~0xffff;
+    uint32_t end_addr = (addr + image.size() + 0xffff) & ~0xffff;
+
+    std::vector<uint8_t> planned(end_addr - begin_addr, 0xFF);
+    for (auto &range : image.ranges())
+    {
+	std::copy(range.data.begin(), range.data.end(), planned.begin() + (addr - begin_addr) + range.offset);
+    }
+
+    FlashDigest digest(begin_addr);
+    digest.update(planned.data(), planned.size());
+    digest.final();
+    const std::vector<FlashDigest::Entry> &sectors = digest.sectors();
+
+    DeltaResult result = { };
+    result.sectors = sectors.size();
+
+    std::vector<size_t> changed;
+    std::vector<size_t> unchanged;
+    for (size_t i = 0; i < sectors.size(); i++)
+    {
+	std::string sha256;
+	if (registry.sector(board, sectors[i].addr, sha256) && sha256 == sectors[i].sha256)
+	    unchanged.push_back(i);
+	else
+	    changed.push_back(i);
+    }
+
+    m_spi.setPhase("Verify");
+    std::shuffle(unchanged.begin(), unchanged.end(), randomEngine());
+    for (size_t i = 0; i < unchanged.size() && i < spotChecks; i++)
+    {
+	const FlashDigest::Entry &sector = sectors[unchanged[i]];
+	result.spotChecked++;
+
+	if (!spotCheck(sector.addr, &planned[sector.addr - begin_addr], sector.length))
+	{
+	    result.outOfBand = true;
+	    registry.forget(board);
+	    changed.insert(changed.end(), unchanged.begin(), unchanged.end());
+	    std::sort(changed.begin(), changed.end());
+	    break;
+	}
+    }
+
+    StepCallback progress = reporter("Program", changed.size() * 0x10000);
+    for (size_t i = 0; i < changed.size(); i++)
+    {
+	const FlashDigest::Entry &sector = sectors[changed[i]];
+	const uint8_t *sector_data = &planned[sector.addr - begin_addr];
+	registry.forget(board, sector.addr);
+
+	m_spi.setPhase("Erase");
+	eraseSector(sector.addr);
+
+	m_spi.setPhase("Program");
+	FlashImage sectorImage;
+	sectorImage.append(sector_data, sector.length);
+	for (auto &range : sectorImage.ranges())
+	    programRange(sector.addr + range.offset, range.data.data(), range.data.size(), nullptr);
+
+	m_spi.setPhase("Verify");
+	verifyRange(sector.addr, sector_data, sector.length, nullptr);
+	registry.record(board, sector.addr, sector.sha256);
+	result.rewritten++;
+
+	if (progress)
+	    progress((i + 1) * 0x10000);
+    }
+    return result;
+}
+
+void FlashProgrammer::powerDown()
+{
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+    m_spi.setPhase("Power down");
+
+    // SPI NAND has no deep power down
+    if (!m_nand)
+	m_spi.flash_power_down();
+}
+
+/* iCE40 slave SPI configuration: the FPGA samples its chip select while it
+ * leaves reset, so CRESET_B is pulsed with chip select held low. After the
+ * bitstream 49 more clocks start the FPGA and CDONE must go high. */
+void FlashProgrammer::programSram(const uint8_t *data, uint32_t length)
+{
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+    m_spi.setPhase("SRAM");
+
+    const uint32_t bulkSize = 64 * 1024;
+    uint8_t cs_bits = m_spi.getCsBits();
+    uint8_t pindir = m_spi.getPinDir() | ICE_CRESET;
+
+    StepCallback progress = reporter("SRAM", length);
+
+    ftditransaction reset(m_spi, "FPGA reset");
+    reset.set_bits_low(0, pindir);
+    reset.flush();
+    m_spi.sleep_us(100);
+
+    // The FPGA clears its configuration memory before it accepts data
+    reset.set_bits_low(ICE_CRESET, pindir);
+    reset.flush();
+    m_spi.sleep_us(2000);
+
+    ftdiresult_ptr cdone = reset.get_bits_low();
+    reset.flush();
+    if (((*cdone)[0] & ICE_CDONE) != 0)
+    {
+	throw std::runtime_error("CDONE is still high after resetting the FPGA.");
+    }
+
+    ftditransaction bulk(m_spi, "Send bitstream");
+    for (uint32_t done = 0; done < length; )
+    {
+	uint32_t size = std::min(bulkSize, length - done);
+
+	bulk.data_out(data + done, size);
+	bulk.flush();
+	done += size;
+
+	if (progress)
+	    progress(done);
+    }
+
+    bulk.data_out({ 0, 0, 0, 0, 0, 0 });
+    bulk.command({ DATA_BITS_OUT(1), 0 });
+    bulk.set_bits_low(cs_bits | ICE_CRESET, pindir);
+    cdone = bulk.get_bits_low();
+    bulk.flush();
+
+    if (((*cdone)[0] & ICE_CDONE) == 0)
+    {
+	throw std::runtime_error("CDONE did not go high, the FPGA rejected the bitstream.");
+    }
+}
+
+std::future<void> FlashProgrammer::eraseChipAsync()
+{
+    return std::async(std::launch::async, [this]() { eraseChip(); });
+}
+
+std::future<void> FlashProgrammer::eraseSectorsAsync(uint32_t addr, uint32_t length)
+{
+    return std::async(std::launch::async, [this, addr, length]() { eraseSectors(addr, length); });
+}
+
+std::future<void> FlashProgrammer::programAsync(uint32_t addr, std::vector<uint8_t> data)
+{
+    auto buffer = std::make_shared<std::vector<uint8_t>>(std::move(data));
+    return std::async(std::launch::async, [this, addr, buffer]() {
+	program(addr, buffer->data(), buffer->size());
+    });
+}
+
+std::future<std::vector<uint8_t>> FlashProgrammer::readAsync(uint32_t addr, uint32_t length)
+{
+    return std::async(std::launch::async, [this, addr, length]() {
+	std::vector<uint8_t> data(length);
+	read(addr, data.data(), length);
+	return data;
+    });
+}
+
+std::future<void> FlashProgrammer::verifyAsync(uint32_t addr, std::vector<uint8_t> data)
+{
+    auto buffer = std::make_shared<std::vector<uint8_t>>(std::move(data));
+    return std::async(std::launch::async, [this, addr, buffer]() {
+	verify(addr, buffer->data(), buffer->size());
+    });
+}
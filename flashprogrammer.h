@@ -0,0 +1,211 @@
+#ifndef FLASH_PROGRAMMER_H
+#define FLASH_PROGRAMMER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "flashimage.h"
+#include "ftdispi.h"
+#include "journal.h"
+#include "spinand.h"
+
+class BoardRegistry;
+class ProgramStream;
+
+/*
+ * Flash programming jobs on top of ftdispi: identification, erase, program,
+ * read and verify, with progress reporting. Every job is available as a
+ * blocking call and as an asynchronous one returning a std::future. Jobs on
+ * one programmer are serialized; separate programmers run independently, so
+ * one process can drive many of them.
+ */
+class FlashProgrammer
+{
+public:
+    typedef std::function<void(const std::string &phase, uint32_t done, uint32_t total)> ProgressCallback;
+    typedef std::function<void(const uint8_t *data, uint32_t length)> DataCallback;
+
+    // Page program commands of an image, built once and sent to many boards
+    struct ProgramBulks
+    {
+	uint8_t jedecId[3];
+	uint32_t divisor;
+	std::vector<std::vector<uint8_t>> bulks;
+	std::vector<uint32_t> done;     // image bytes programmed after each bulk
+    };
+
+    // One edit of a patch: bytes to place at a flash address
+    struct PatchEdit
+    {
+	uint32_t addr;
+	std::vector<uint8_t> data;
+    };
+
+    // How a patch was applied: edits by outcome and the flash work done
+    struct PatchResult
+    {
+	uint32_t unchanged;     // already in the flash
+	uint32_t direct;        // programmed in place, clearing bits only
+	uint32_t rewritten;     // applied by rewriting their 4 kB subsector
+	uint32_t subsectors;
+	uint32_t pagePrograms;
+    };
+
+    // Sectors of a delta update, see programDelta()
+    struct DeltaResult
+    {
+	uint32_t sectors;
+	uint32_t rewritten;
+	uint32_t spotChecked;
+	bool outOfBand;         // a spot check found the flash changed behind the registry
+    };
+
+    // Outcome of checked reads, see setCheckedReads()
+    struct ReadStats
+    {
+	uint32_t chunks;
+	uint32_t fallbacks;     // chunks read again at the normal clock
+	uint32_t slowReads;
+	uint32_t confirmed;     // chunks compared against a read at the normal clock
+	bool fastFailed;        // a comparison failed and fast reads were turned off
+    };
+
+    static const std::vector<FlashConfig> &memories();
+    static const FlashConfig *findMemory(const std::string &name);
+    static const FlashConfig *findMemory(const uint8_t jedecId[3]);
+
+    FlashProgrammer();
+
+    void open(enum ftdi_interface ifnum, const char *devstr);
+    void open(ftdisink *sink);
+
+    void setProgressCallback(ProgressCallback callback);
+
+    /* Reads every chunk twice at the fast divisor and accepts it when both copies
+     * agree; otherwise the chunk is read at the normal clock until a copy is
+     * confirmed. The first chunk and every 64th after it are also read at the
+     * normal clock, since both fast copies can be wrong the same way; when
+     * they differ from it, the rest is read at the normal clock only. 0 turns
+     * checked reads off. */
+    void setCheckedReads(uint32_t fastDivisor);
+    const ReadStats &readStats() const  { return m_readStats; }
+
+    /* Lets read() calls from other threads, buffered or streaming, interrupt
+     * SPI NOR erases: the erase is suspended for the read and resumed
+     * afterwards, so reads no longer wait for it to finish. Between suspends
+     * the erase keeps running for a while, so reads are delayed by up to
+     * that much. verify() and every other job still wait for the erase. The
+     * memory has to support erase suspend; reads of the sector being erased
+     * return undefined data. A chip erase cannot be suspended, reads during
+     * one still wait for it. */
+    void setEraseSuspend(bool enable);
+
+    ftdispi &spi()                      { return m_spi; }
+    const uint8_t *jedecId() const      { return m_jedecId; }
+    const FlashConfig &config() const;
+    // Usable size; for SPI NAND the good blocks only
+    uint32_t size() const;
+    const SpiNand *nand() const         { return m_nand.get(); }
+
+    // Reads the JEDEC ID; returns nullptr for an unknown memory
+    const FlashConfig *identify();
+    // The factory programmed unique ID in hex; throws if the memory has none
+    std::string uniqueId();
+
+    void waitReady();
+    void eraseChip();
+    void eraseSectors(uint32_t addr, uint32_t length);
+    void program(uint32_t addr, const uint8_t *data, uint32_t length);
+    void read(uint32_t addr, uint8_t *data, uint32_t length);
+    void verify(uint32_t addr, const uint8_t *data, uint32_t length);
+    void program(uint32_t addr, const FlashImage &image);
+    void read(uint32_t addr, uint32_t length, DataCallback consumer);
+    void verify(uint32_t addr, const FlashImage &image);
+    ProgramBulks buildProgram(uint32_t addr, const FlashImage &image);
+    void program(const ProgramBulks &program);
+    // Compiled streams must match the memory, clock and pin setup as well
+    void checkStream(const ProgramStream &stream);
+    void program(const ProgramStream &stream);
+    void verify(const ProgramStream &stream);
+    // Erases, programs and verifies only the sectors that differ from the previous image
+    uint32_t programChanges(uint32_t addr, const FlashImage &image, const FlashImage &previous);
+    uint32_t programResumable(ProgressJournal &journal, uint32_t addr, const uint8_t *data, uint32_t length, bool erase);
+    // Rewrites only the sectors that differ from what the registry has on record for this chip
+    DeltaResult programDelta(BoardRegistry &registry, uint32_t addr, const FlashImage &image, uint32_t spotChecks);
+    // Applies small edits, e.g. per-board serial numbers or calibration data
+    PatchResult patch(const std::vector<PatchEdit> &edits);
+    void powerDown();
+
+    // Configures an iCE40 FPGA directly from a bitstream, bypassing the flash
+    void programSram(const uint8_t *data, uint32_t length);
+
+    std::future<void> eraseChipAsync();
+    std::future<void> eraseSectorsAsync(uint32_t addr, uint32_t length);
+    std::future<void> programAsync(uint32_t addr, std::vector<uint8_t> data);
+    std::future<std::vector<uint8_t>> readAsync(uint32_t addr, uint32_t length);
+    std::future<void> verifyAsync(uint32_t addr, std::vector<uint8_t> data);
+
+private:
+    typedef std::function<void(uint32_t done)> StepCallback;
+    typedef std::function<void(ftditransaction &bulk, uint32_t done)> BulkCallback;
+
+    // A read handed to the thread waiting for an erase, see setEraseSuspend()
+    struct SuspendRead
+    {
+	uint32_t addr;
+	uint8_t *data;
+	uint32_t length;
+	bool done;
+	std::exception_ptr error;
+    };
+
+    ftdispi m_spi;
+    std::recursive_mutex m_mutex;
+    ProgressCallback m_progress;
+
+    uint8_t m_jedecId[3] = { };
+    const FlashConfig *m_config = nullptr;
+    const struct ChipProfile *m_profile = nullptr;
+    std::unique_ptr<SpiNand> m_nand;
+    uint32_t m_fastDivisor = 0;
+    ReadStats m_readStats = { };
+
+    std::atomic<bool> m_eraseSuspend;
+    std::mutex m_suspendMutex;
+    std::condition_variable m_suspendCond;
+    bool m_erasing = false;                     // an erase is waited for and may be suspended
+    std::vector<SuspendRead *> m_suspendReads;
+
+    // Read size per USB round trip
+    static const uint32_t readChunkSize = 7 * 1024;
+
+    StepCallback reporter(const std::string &phase, uint32_t total);
+    void eraseSector(uint32_t sector);
+    void waitErase(ftditransaction &erase, int interval, int duration, bool suspendable);
+    bool suspendErase();
+    void serveReads(std::vector<SuspendRead *> &reads, bool suspend);
+    bool readDuringErase(std::unique_lock<std::recursive_mutex> &lock, uint32_t addr, uint8_t *data, uint32_t length);
+    void buildBulks(uint32_t addr, const uint8_t *data, uint32_t length, BulkCallback emit);
+    void programRange(uint32_t addr, const uint8_t *data, uint32_t length, StepCallback progress);
+    ftdiresult_ptr flashRead(uint32_t addr, uint32_t length);
+    ftdiresult_ptr checkedRead(uint32_t addr, uint32_t length);
+    void flashRead(uint32_t addr, uint8_t *data, uint32_t length);
+    void verifyRange(uint32_t addr, const uint8_t *data, uint32_t length, StepCallback progress);
+    void verifyFill(uint32_t addr, uint32_t length, uint8_t fill, StepCallback progress);
+    void verifyNand(uint32_t addr, const FlashImage &image, StepCallback progress);
+    void readRanges(std::vector<PatchEdit> &ranges);
+    bool spotCheck(uint32_t addr, const uint8_t *data, uint32_t length);
+
+    FlashProgrammer(const FlashProgrammer &);
+    FlashProgrammer & operator = (FlashProgrammer &);
+};
+
+#endif // FLASH_PROGRAMMER_H
@@ -31,9 +31,23 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
 
-#include "ftdispi.h"
+#include "flashprogrammer.h"
+#include "flashimage.h"
+#include "asyncoutput.h"
+#include "digest.h"
+#include "journal.h"
+#include "registry.h"
+#include "planner.h"
+#include "programstream.h"
+#include "station.h"
+#include "watch.h"
 
+#include <chrono>
+#include <memory>
 #include <limits>
 #include <string>
 #include <cstring>
@@ -68,6 +82,8 @@ void help(const char *progname)
 	fprintf(stderr, "        read the specified number of bytes from flash\n");
 	fprintf(stderr, "        (append 'k' to the argument for size in kilobytes, or\n");
 	fprintf(stderr, "        'M' for size in megabytes)\n");
+	fprintf(stderr, "        with - as filename, the data is written to stdout and\n");
+	fprintf(stderr, "        status messages to stderr\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "    -o <offset_in_bytes>\n");
 	fprintf(stderr, "        start address for read/write (instead of zero)\n");
@@ -83,12 +99,90 @@ void help(const char *progname)
 	fprintf(stderr, "    -n\n");
 	fprintf(stderr, "        do not erase flash before writing\n");
 	fprintf(stderr, "\n");
+	fprintf(stderr, "    -S\n");
+	fprintf(stderr, "        perform SRAM programming of an iCE40 FPGA: hold CRESET_B\n");
+	fprintf(stderr, "        (ADBUS7) low, stream the bitstream directly into the FPGA and\n");
+	fprintf(stderr, "        check CDONE (ADBUS6); the flash is not touched\n");
+	fprintf(stderr, "\n");
 	fprintf(stderr, "    -t\n");
 	fprintf(stderr, "        just read the flash ID sequence\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "    -v\n");
 	fprintf(stderr, "        verbose output\n");
 	fprintf(stderr, "\n");
+	fprintf(stderr, "    --resume\n");
+	fprintf(stderr, "        erase, program and verify sector by sector, recording each\n");
+	fprintf(stderr, "        completed sector in a journal; if a journal for the same image,\n");
+	fprintf(stderr, "        programmer and flash exists, continue where it stopped\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "    --journal <filename>\n");
+	fprintf(stderr, "        journal file for --resume (default: <filename>.journal)\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "    --registry[=<filename>]\n");
+	fprintf(stderr, "        delta update: look the board up by the flash unique ID in a\n");
+	fprintf(stderr, "        registry of what was last programmed on it and erase, program\n");
+	fprintf(stderr, "        and verify only the 64 kB sectors that differ; a few random\n");
+	fprintf(stderr, "        unchanged sectors are spot checked, and if one was changed\n");
+	fprintf(stderr, "        outside the registry, all sectors are rewritten\n");
+	fprintf(stderr, "        (default: ~/.ftdiflash-registry)\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "    --dump\n");
+	fprintf(stderr, "        in read mode, write a range-list dump that stores only the\n");
+	fprintf(stderr, "        non-blank pages instead of a raw image; dumps are accepted\n");
+	fprintf(stderr, "        as input wherever a raw image is\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "    --digest\n");
+	fprintf(stderr, "        read the flash without writing it anywhere and print a\n");
+	fprintf(stderr, "        manifest of SHA-256 and CRC-32 digests of the range and of\n");
+	fprintf(stderr, "        every 64 kB sector in it; the range is set with -o and -R\n");
+	fprintf(stderr, "        (default: the rest of the flash); status messages go to stderr\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "    --station[=<serial-pattern>]\n");
+	fprintf(stderr, "        production station: keep the image loaded, wait for FT2232H\n");
+	fprintf(stderr, "        and FT4232H programmers to be plugged in and erase, program and\n");
+	fprintf(stderr, "        verify every board that arrives, several at once; only boards\n");
+	fprintf(stderr, "        whose serial number matches the pattern (e.g. 'FT4*') are\n");
+	fprintf(stderr, "        programmed; stop with Ctrl-C\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "    --station-log <filename>\n");
+	fprintf(stderr, "        append a pass/fail line per board to the file\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "    --station-slots <n>\n");
+	fprintf(stderr, "        boards behind one hub or root port that may program or\n");
+	fprintf(stderr, "        verify at once; the others erase or wait (default: 2)\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "    --patch <offset>:<hex-bytes>\n");
+	fprintf(stderr, "    --patch @<filename>\n");
+	fprintf(stderr, "        change a few bytes (e.g. a MAC address) without a reflash;\n");
+	fprintf(stderr, "        may be given several times, a file holds one edit per line;\n");
+	fprintf(stderr, "        edits that only clear bits are programmed in place, others\n");
+	fprintf(stderr, "        rewrite just their 4 kB subsector\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "    --fast-read[=<divisor>]\n");
+	fprintf(stderr, "        read and verify at the SPI clock of the given divisor (even,\n");
+	fprintf(stderr, "        default 4: 15 MHz); every chunk is read twice and, when the\n");
+	fprintf(stderr, "        copies differ, read again at the normal clock; the first\n");
+	fprintf(stderr, "        chunk and every 64th are compared with a normal clock read\n");
+	fprintf(stderr, "        and the fast clock is dropped if they differ\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "    --watch\n");
+	fprintf(stderr, "        program the image, then keep the device open and watch the\n");
+	fprintf(stderr, "        file; on every rebuild only the 64 kB sectors that changed\n");
+	fprintf(stderr, "        are erased, programmed and verified (SPI NAND: the whole image);\n");
+	fprintf(stderr, "        the first program erases as set by -b; stop with Ctrl-C\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "    --compile <stream-file>\n");
+	fprintf(stderr, "        do not program, but write a stream file holding the program\n");
+	fprintf(stderr, "        commands for the memory and SPI clock (from the device or\n");
+	fprintf(stderr, "        --plan), the erase plan (-b, -n) and the digests to verify\n");
+	fprintf(stderr, "        against; a stream file given as <filename> is programmed\n");
+	fprintf(stderr, "        as is, at the offset it was compiled for\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "    --plan[=<memory-name>]\n");
+	fprintf(stderr, "        dry run: build the command stream of the job without opening\n");
+	fprintf(stderr, "        a device and print its predicted duration per phase\n");
+	fprintf(stderr, "        (default memory: %s)\n", FlashProgrammer::memories()[0].memoryName.c_str());
+	fprintf(stderr, "\n");
 	fprintf(stderr, "Without -b or -n, ftdiflash will erase aligned chunks of 64kB in write mode.\n");
 	fprintf(stderr, "This means that some data after the written data (or even before when -o is\n");
 	fprintf(stderr, "used) may be erased as well.\n");
@@ -96,16 +190,219 @@ void help(const char *progname)
 	exit(1);
 }
 
-FlashConfig memory[] = 
+/* Prints job progress in steps of 10%, or every step in verbose mode. */
+class ProgressPrinter
 {
-    // Manufacturer   Manufacturer  Memory       Memory      Memory              Page Program  64k block Erase
-    // Name           Id            Ids          Name        Size                Time          Time
-    { "Winbond",      0xEF,         0x40, 0x18, "W25Q128JV", 16 * 1024 * 1024,   800,          2000 }    
+public:
+    ProgressPrinter(bool verbose) : m_verbose(verbose) {}
+
+    void operator () (const std::string &phase, uint32_t done, uint32_t total)
+    {
+	if (phase != m_phase)
+	{
+	    m_phase = phase;
+	    m_cent = 0;
+	}
+
+	if (m_verbose)
+	{
+	    std::cout << std::endl << phase << " " << done << "/" << total << " bytes" << std::flush;
+	    return;
+	}
+
+	uint32_t new_cent = total ? ((uint64_t)done * 100) / total : 100;
+	new_cent = new_cent - (new_cent % 10);
+	if (new_cent >= (m_cent + 10))
+	{
+	    m_cent = new_cent;
+	    std::cout << m_cent << "% " << std::flush;
+	}
+    }
+
+private:
+    bool m_verbose;
+    std::string m_phase;
+    uint32_t m_cent = 0; // percentage progress
 };
 
+/* Parses patch edits "<offset>:<hex bytes>", or "@<file>" holding one edit per
+ * line ('#' starts a comment). Offsets are relative to the -o start address. */
+static std::vector<FlashProgrammer::PatchEdit> loadPatch(const std::vector<std::string> &specs, uint32_t base)
+{
+	std::vector<FlashProgrammer::PatchEdit> edits;
+	auto parse = [&edits, base](std::string spec) {
+	    spec = spec.substr(0, spec.find('#'));
+	    spec.erase(0, spec.find_first_not_of(" \t\r"));
+	    spec.erase(spec.find_last_not_of(" \t\r") + 1);
+	    if (spec.empty())
+		return;
+
+	    size_t colon = spec.find(':');
+	    char *endptr;
+	    FlashProgrammer::PatchEdit edit;
+	    edit.addr = base + strtoul(spec.c_str(), &endptr, 0);
+	    if (colon == std::string::npos || endptr != spec.c_str() + colon || (spec.size() - colon - 1) % 2 != 0 ||
+		spec.find_first_not_of("0123456789abcdefABCDEF", colon + 1) != std::string::npos)
+	    {
+		throw std::runtime_error(Formatter() << "Invalid patch edit '" << spec << "'.");
+	    }
+	    for (size_t i = colon + 1; i < spec.size(); i += 2)
+		edit.data.push_back(strtoul(spec.substr(i, 2).c_str(), NULL, 16));
+	    edits.push_back(edit);
+	};
+
+	for (auto &spec : specs)
+	{
+	    if (spec[0] != '@')
+	    {
+		parse(spec);
+		continue;
+	    }
+
+	    std::ifstream file(spec.substr(1));
+	    if (!file)
+		throw std::runtime_error(Formatter() << "Could not open patch file " << spec.substr(1) << ".");
+	    std::string line;
+	    while (std::getline(file, line))
+		parse(line);
+	}
+	return edits;
+}
+
+static ProductionStation *activeStation = nullptr;
+
+static void stopStation(int)
+{
+	if (activeStation != nullptr)
+	    activeStation->stop();
+}
+
+static volatile sig_atomic_t watchStop = 0;
+
+static void stopWatch(int)
+{
+	watchStop = 1;
+}
+
+/* Programs the image, then reprograms the sectors each new build of it changes,
+ * until interrupted. After a failed update the flash contents are unknown and
+ * the next build is programmed in full. */
+static void watchImage(FlashProgrammer &programmer, const std::string &filename, uint32_t offset, bool bulk_erase)
+{
+	ImageWatcher watcher(filename);
+	FlashImage last;
+	bool known = false;
+
+	signal(SIGINT, stopWatch);
+	signal(SIGTERM, stopWatch);
+
+	bool changed = true;
+	while (!watchStop)
+	{
+	    if (!changed)
+	    {
+		changed = watcher.wait(250);
+		continue;
+	    }
+	    changed = false;
+
+	    FlashImage image;
+	    try
+	    {
+		image = FlashImage::load(filename);
+	    }
+	    catch (std::exception &e)
+	    {
+		std::cout << "Exception: " << e.what() << std::endl;
+		continue;
+	    }
+
+	    auto begin = std::chrono::steady_clock::now();
+	    try
+	    {
+		// SPI NAND places the image around bad blocks, so it is always rewritten whole
+		if (known && programmer.nand() == nullptr)
+		{
+		    std::cout << "Image changed, reprogramming... " << std::flush;
+		    uint32_t sectors = programmer.programChanges(offset, image, last);
+		    std::cout << "Done." << std::endl;
+		    std::cout << sectors << " of " << (((offset + image.size() + 0xffff) & ~0xffff) - (offset & ~0xffff)) / 0x10000 <<
+			" sectors changed";
+		}
+		else
+		{
+		    std::cout << "Programming image... " << std::flush;
+		    if (bulk_erase && !known)
+			programmer.eraseChip();
+		    else
+			programmer.eraseSectors(offset, image.size());
+		    programmer.waitReady();
+		    programmer.program(offset, image);
+		    programmer.verify(offset, image);
+		    std::cout << "Done." << std::endl;
+		    std::cout << image.size() << " bytes programmed";
+		}
+		last = image;
+		known = true;
+	    }
+	    catch (std::exception &e)
+	    {
+		std::cout << std::endl << "Exception: " << e.what() << std::endl;
+		std::cout << "Retrying in a second." << std::endl;
+		known = false;
+
+		// Retried with a full program, or with a newer build if one arrives meanwhile
+		watcher.wait(1000);
+		changed = true;
+		continue;
+	    }
+
+	    std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - begin;
+	    std::cout << ", " << seconds.count() << " s. Waiting for " << filename << " to change, press Ctrl-C to stop." <<
+		std::endl;
+	}
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+}
+
+/* Programs every board that is plugged in until interrupted. */
+int runStation(const char *filename, const ProductionStation::Config &config)
+{
+	try
+	{
+	    FlashImage image = FlashImage::load(filename);
+
+	    std::cout << "File name: " << filename << std::endl;
+	    std::cout << "File size: " << image.size() << " bytes, " << image.dataSize() << " bytes in " <<
+		image.ranges().size() << " non-blank ranges" << std::endl;
+
+	    ProductionStation station(image, config);
+	    activeStation = &station;
+	    signal(SIGINT, stopStation);
+	    signal(SIGTERM, stopStation);
+
+	    std::cout << "Waiting for boards with serial number " << config.serialPattern <<
+		", press Ctrl-C to stop." << std::endl;
+	    station.run();
+	    activeStation = nullptr;
+
+	    std::cout << std::endl << "Station stopped: " << station.passed() << " passed, " <<
+		station.failed() << " failed." << std::endl;
+	    return station.failed() == 0 ? 0 : 1;
+	}
+	catch (std::exception& e)
+	{
+	    activeStation = nullptr;
+	    std::cout << std::endl << "Exception: " << e.what() << std::endl;
+	    return 1;
+	}
+}
+
 int main(int argc, char **argv)
 {
 	int read_size = 256 * 1024;
+	bool read_size_given = false;
+	bool offset_given = false;
 	int rw_offset = 0;
 	bool verbose = false;
 	bool read_mode = false;
@@ -114,13 +411,62 @@ int main(int argc, char **argv)
 	bool dont_erase = false;
 	bool prog_sram = false;
 	bool test_mode = false;
+	bool resume = false;
+	bool plan_mode = false;
+	bool dump_mode = false;
+	bool digest_mode = false;
+	bool station_mode = false;
+	ProductionStation::Config stationConfig;
+	std::vector<std::string> patchSpecs;
+	const char *compileFilename = NULL;
+	bool watch_mode = false;
+	uint32_t fastDivisor = 0;
+	const char *planMemory = NULL;
 	const char *inputFilename = NULL;
+	const char *journalFilename = NULL;
+	bool registry_mode = false;
+	std::string registryFilename;
 	const char *devstr = NULL;
 	enum ftdi_interface ifnum = INTERFACE_A;
 
+	enum
+	{
+		OPT_RESUME = 256,
+		OPT_JOURNAL,
+		OPT_PLAN,
+		OPT_DUMP,
+		OPT_DIGEST,
+		OPT_STATION,
+		OPT_STATION_LOG,
+		OPT_PATCH,
+		OPT_COMPILE,
+		OPT_WATCH,
+		OPT_FAST_READ,
+		OPT_STATION_SLOTS,
+		OPT_REGISTRY
+	};
+
+	static const struct option long_options[] =
+	{
+		{ "resume",  no_argument,       NULL, OPT_RESUME },
+		{ "journal", required_argument, NULL, OPT_JOURNAL },
+		{ "plan",    optional_argument, NULL, OPT_PLAN },
+		{ "dump",    no_argument,       NULL, OPT_DUMP },
+		{ "digest",  no_argument,       NULL, OPT_DIGEST },
+		{ "station", optional_argument, NULL, OPT_STATION },
+		{ "station-log", required_argument, NULL, OPT_STATION_LOG },
+		{ "patch",   required_argument, NULL, OPT_PATCH },
+		{ "compile", required_argument, NULL, OPT_COMPILE },
+		{ "watch",   no_argument,       NULL, OPT_WATCH },
+		{ "fast-read", optional_argument, NULL, OPT_FAST_READ },
+		{ "station-slots", required_argument, NULL, OPT_STATION_SLOTS },
+		{ "registry", optional_argument, NULL, OPT_REGISTRY },
+		{ NULL, 0, NULL, 0 }
+	};
+
 	int opt;
 	char *endptr;
-	while ((opt = getopt(argc, argv, "d:I:rR:o:cbnStv")) != -1)
+	while ((opt = getopt_long(argc, argv, "d:I:rR:o:cbnStv", long_options, NULL)) != -1)
 	{
 		switch (opt)
 		{
@@ -140,6 +486,7 @@ int main(int argc, char **argv)
 		case 'R':
 			read_mode = true;
 			read_size = strtol(optarg, &endptr, 0);
+			read_size_given = true;
 			if (!strcmp(endptr, "k")) read_size *= 1024;
 			if (!strcmp(endptr, "M")) read_size *= 1024 * 1024;
 			break;
@@ -147,6 +494,7 @@ int main(int argc, char **argv)
 			rw_offset = strtol(optarg, &endptr, 0);
 			if (!strcmp(endptr, "k")) rw_offset *= 1024;
 			if (!strcmp(endptr, "M")) rw_offset *= 1024 * 1024;
+			offset_given = true;
 			break;
 		case 'c':
 			check_mode = true;
@@ -157,12 +505,61 @@ int main(int argc, char **argv)
 		case 'n':
 			dont_erase = true;
 			break;
+		case 'S':
+			prog_sram = true;
+			break;
 		case 't':
 			test_mode = true;
 			break;
 		case 'v':
 			verbose = true;
 			break;
+		case OPT_RESUME:
+			resume = true;
+			break;
+		case OPT_JOURNAL:
+			journalFilename = optarg;
+			break;
+		case OPT_PLAN:
+			plan_mode = true;
+			planMemory = optarg;
+			break;
+		case OPT_DUMP:
+			dump_mode = true;
+			break;
+		case OPT_DIGEST:
+			digest_mode = true;
+			break;
+		case OPT_STATION:
+			station_mode = true;
+			if (optarg != NULL)
+				stationConfig.serialPattern = optarg;
+			break;
+		case OPT_STATION_LOG:
+			stationConfig.logPath = optarg;
+			break;
+		case OPT_PATCH:
+			patchSpecs.push_back(optarg);
+			break;
+		case OPT_COMPILE:
+			compileFilename = optarg;
+			break;
+		case OPT_WATCH:
+			watch_mode = true;
+			break;
+		case OPT_FAST_READ:
+			fastDivisor = optarg != NULL ? strtol(optarg, NULL, 0) : 4;
+			break;
+		case OPT_STATION_SLOTS:
+			if (strtol(optarg, NULL, 0) < 1)
+				help(argv[0]);
+			stationConfig.linkSlots = strtol(optarg, NULL, 0);
+			break;
+		case OPT_REGISTRY:
+			registry_mode = true;
+			if (optarg != NULL)
+				registryFilename = optarg;
+			break;
 		default:
 			help(argv[0]);
 		}
@@ -174,7 +571,49 @@ int main(int argc, char **argv)
 	if (bulk_erase && dont_erase)
 	    help(argv[0]);
 
-	if (optind+1 != argc && !test_mode)
+	if (resume && (read_mode || check_mode || test_mode || prog_sram))
+	    help(argv[0]);
+
+	if (prog_sram && optind + 1 != argc)
+	    help(argv[0]);
+
+	if (dump_mode && !read_mode)
+	    help(argv[0]);
+
+	// -R only selects the range to digest
+	if (digest_mode)
+	{
+	    if (check_mode || test_mode || prog_sram || resume || dump_mode || optind != argc)
+		help(argv[0]);
+	    read_mode = false;
+	}
+
+	if (station_mode && (read_mode || check_mode || test_mode || prog_sram || resume || plan_mode || digest_mode ||
+	    devstr != NULL || optind + 1 != argc))
+	    help(argv[0]);
+
+	bool patch_mode = !patchSpecs.empty();
+	if (patch_mode && (read_mode || check_mode || test_mode || prog_sram || resume || digest_mode || station_mode ||
+	    optind != argc))
+	    help(argv[0]);
+
+	if (compileFilename != NULL && (read_mode || check_mode || test_mode || prog_sram || resume || digest_mode ||
+	    station_mode || patch_mode))
+	    help(argv[0]);
+
+	if (watch_mode && (read_mode || check_mode || test_mode || prog_sram || resume || digest_mode || station_mode ||
+	    patch_mode || plan_mode || compileFilename != NULL || dont_erase || optind + 1 != argc))
+	    help(argv[0]);
+
+	if (registry_mode && (read_mode || check_mode || test_mode || prog_sram || resume || dont_erase || plan_mode ||
+	    digest_mode || station_mode || patch_mode || compileFilename != NULL || watch_mode || optind + 1 != argc))
+	    help(argv[0]);
+
+	// A chip erase cannot be resumed, so --resume always works sector by sector
+	if (resume || registry_mode)
+	    bulk_erase = false;
+
+	if (optind+1 != argc && !test_mode && !digest_mode && !patch_mode)
 	{
 	    if (bulk_erase && optind == argc)
 	    	inputFilename = "/dev/null";
@@ -186,179 +625,349 @@ int main(int argc, char **argv)
 	    inputFilename = argv[optind];
 	}
 
+	// A stream file carries its own offset and erase plan
+	bool stream_mode = inputFilename != NULL && !read_mode && ProgramStream::isStream(inputFilename);
+	if (stream_mode && (rw_offset != 0 || !bulk_erase || dont_erase || resume || prog_sram || station_mode ||
+	    compileFilename != NULL || watch_mode || registry_mode))
+	    help(argv[0]);
+
+	// A range-list dump goes back to the address it was read from
+	if (inputFilename != NULL && !read_mode && !stream_mode && !prog_sram && FlashImage::isDump(inputFilename))
+	{
+	    uint32_t base = 0;
+	    try
+	    {
+		base = FlashImage::dumpBase(inputFilename);
+	    }
+	    catch (std::exception &e)
+	    {
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	    }
+	    if (offset_given && (uint32_t)rw_offset != base)
+	    {
+		fprintf(stderr, "%s was dumped from address 0x%x; leave out -o or give that address.\n",
+		    inputFilename, base);
+		return 1;
+	    }
+	    rw_offset = base;
+	}
+
+	// Streaming the flash or the manifest to stdout, status messages go to stderr
+	bool to_stdout = digest_mode || (read_mode && inputFilename != NULL && !strcmp(inputFilename, "-"));
+	std::streambuf *coutBuffer = std::cout.rdbuf();
+	if (to_stdout)
+	    std::cout.rdbuf(std::cerr.rdbuf());
+
+	if (station_mode)
+	{
+	    stationConfig.ifnum = ifnum;
+	    stationConfig.offset = rw_offset;
+	    stationConfig.erase = dont_erase ? ProductionStation::ERASE_NONE :
+		bulk_erase ? ProductionStation::ERASE_CHIP : ProductionStation::ERASE_SECTORS;
+	    return runStation(inputFilename, stationConfig);
+	}
+
 	// ---------------------------------------------------------
 	// Initialize USB connection to FT2232H
 	// ---------------------------------------------------------
 
-	char* fileBuffer = nullptr;
-
 	int result = 0;
 	try
 	{
-	    ftdispi spi;
+	    FlashProgrammer programmer;
+	    ftdispi &spi = programmer.spi();
 	    std::cout << "FTDI driver version: " << spi.getVersion() << std::endl << std::flush;
 
-	    spi.open(ifnum, devstr);
+	    std::unique_ptr<JobPlanner> planner;
+	    if (plan_mode)
+	    {
+		const FlashConfig *config = &FlashProgrammer::memories()[0];
+		if (planMemory != NULL)
+		    config = FlashProgrammer::findMemory(planMemory);
+		if (config == nullptr)
+		    throw std::runtime_error(Formatter() << "Unknown memory " << planMemory << " to plan for.");
+
+		std::cout << "Planning job, no device is opened." << std::endl;
+		planner.reset(new JobPlanner(*config));
+		programmer.open(planner.get());
+	    }
+	    else
+	    {
+		programmer.open(ifnum, devstr);
+	    }
 	    std::cout << "MPSSE clock: " << 
 		spi.getClock() << " MHz, divisor: " <<
 		spi.getDivisor() << ", SPI clock: " <<
 		(double)(spi.getClock() / spi.getDivisor()) << " MHz\n";
 
-	    usleep(250000);
-
-	    spi.flash_power_up();
+	    spi.sleep_us(250000);
 
-	    std::cout << "Reading flash ID... ";
-	    std::list<uint8_t> id;
-	    spi.flash_read_id(id);
-	    std::cout <<  "Flash ID: ";
-	    for (std::list<uint8_t>::iterator it = id.begin(); it != id.end(); it++)
+	    // SRAM configuration goes straight into the FPGA, the flash is not involved
+	    const FlashConfig *config = nullptr;
+	    if (!prog_sram)
 	    {
-	        std::cout << "0x" << std::setfill('0') << std::setw(2) << std::hex << (int)(*it) << " ";
-	    }
-	    std::cout << std::dec << std::endl << std::flush;
+		std::cout << "Reading flash ID... ";
+		config = programmer.identify();
 
-	    uint32_t pageProgramTime = 0;
-	    uint32_t blockEraseTime64k = 0;
+		std::cout <<  "Flash ID: ";
+		for (int i = 0; i < 3; i++)
+		{
+		    std::cout << "0x" << std::setfill('0') << std::setw(2) << std::hex << (int)programmer.jedecId()[i] << " ";
+		}
+		std::cout << std::dec << std::endl << std::flush;
 
-	    if (id.size() != 3)
-		throw std::runtime_error("Unable to identify flash memory. (Wrong memory response)");
+		if (config == nullptr)
+		    throw std::runtime_error("Unknown flash memory.");
 
-	    uint8_t flashId[3];
-	    uint8_t iFlashId = 0;
-	    for (std::list<uint8_t>::iterator it = id.begin(); it != id.end(); it++)
-	    {
-		flashId[iFlashId++] =  (uint8_t)(*it);
+		std::cout << "Found memory " << config->manfacturerName << ", " << config->memoryName << ", Size=" << config->size << " bytes." << std::endl << std::flush;
+		if (programmer.nand() != nullptr)
+		{
+		    std::cout << "Bad blocks: " << programmer.nand()->badBlocks().size() << ", usable size=" <<
+			programmer.size() << " bytes." << std::endl << std::flush;
+		}
 	    }
 
-	    bool found = false;
-	    for (auto item : memory)
+	    ProgressPrinter printer(verbose);
+	    programmer.setProgressCallback(std::ref(printer));
+	    programmer.setCheckedReads(fastDivisor);
+
+	    if (prog_sram)
+	    {
+		std::vector<uint8_t> bitstream = FlashImage::load(inputFilename).flatten();
+
+		std::cout << "File name: " << inputFilename << std::endl;
+		std::cout << "File size: " << bitstream.size() << " bytes" << std::endl;
+		std::cout << std::endl;
+
+		std::cout << "Programming FPGA SRAM... " << std::flush;
+		programmer.programSram(bitstream.data(), bitstream.size());
+		std::cout << "Done." << std::endl;
+		std::cout << "CDONE is high, the FPGA is configured." << std::endl;
+	    }
+	    else if (digest_mode)
 	    {
-		if (item.manufacturerId == flashId[0] &&
-		    item.ID15_ID8 == flashId[1] &&
-		    item.ID7_ID0 == flashId[2])
+		if (rw_offset < 0 || (uint32_t)rw_offset >= programmer.size())
+		    throw std::runtime_error(Formatter() << "Offset " << rw_offset << " is beyond the end of the flash.");
+		if (read_size_given && (read_size < 0 || (uint32_t)read_size > programmer.size() - rw_offset))
+		    throw std::runtime_error(Formatter() << "Range of " << read_size << " bytes at " << rw_offset <<
+			" runs past the end of the flash.");
+
+		uint32_t length = read_size_given ? read_size : programmer.size() - rw_offset;
+		FlashDigest digest(rw_offset);
+
+		// Digests are computed on the buffer's worker thread while the next blocks are read
+		{
+		    AsyncOutputBuffer digestBuffer([&digest](const char *data, size_t size) {
+			digest.update((const uint8_t *)data, size);
+		    });
+		    std::cout << "Computing digests... " << std::flush;
+		    programmer.read(rw_offset, length, [&digestBuffer](const uint8_t *data, uint32_t size) {
+			digestBuffer.sputn((const char *)data, size);
+		    });
+		    digestBuffer.finish();
+		    std::cout << "Done." << std::endl;
+		}
+		digest.final();
+
+		std::ostream manifest(coutBuffer);
+		manifest << "flash " << config->memoryName << " jedec=" << std::hex << std::setfill('0');
+		for (int i = 0; i < 3; i++)
 		{
-		    found = true;
-		    std::cout << "Found memory " << item.manfacturerName << ", " << item.memoryName << ", Size=" << item.size << " bytes." << std::endl << std::flush;
-		    pageProgramTime = item.pageProgramTime;
-		    blockEraseTime64k = item.blockEraseTime64k;
+		    manifest << std::setw(2) << (int)programmer.jedecId()[i];
 		}
+		manifest << std::dec << std::setfill(' ') << std::endl;
+		digest.manifest(manifest);
+	    }
+	    else if (watch_mode)
+	    {
+		watchImage(programmer, inputFilename, rw_offset, bulk_erase);
 	    }
+	    else if (compileFilename != NULL)
+	    {
+		FlashImage image = FlashImage::load(inputFilename);
+		ProgramStream::EraseMode erase = dont_erase ? ProgramStream::ERASE_NONE :
+		    bulk_erase ? ProgramStream::ERASE_CHIP : ProgramStream::ERASE_SECTORS;
 
-	    if (found == false)
-		throw std::runtime_error("Unknown flash memory.");
+		std::cout << "File name: " << inputFilename << std::endl;
+		std::cout << "File size: " << image.size() << " bytes, " << image.dataSize() << " bytes in " <<
+		    image.ranges().size() << " non-blank ranges" << std::endl;
+		std::cout << std::endl;
 
-	    if (!test_mode)
+		std::cout << "Compiling stream... " << std::flush;
+		ProgramStream::compile(programmer, rw_offset, image, erase, compileFilename);
+		std::cout << "Done." << std::endl;
+		std::cout << "Stream for " << config->memoryName << " at divisor " << spi.getDivisor() <<
+		    " written to " << compileFilename << std::endl;
+	    }
+	    else if (stream_mode)
 	    {
+		ProgramStream stream(inputFilename);
 
-		std::string filename(inputFilename);
-		std::ifstream fileStream;
+		std::cout << "Stream file: " << inputFilename << std::endl;
+		std::cout << "Image size: " << stream.size() << " bytes at address " << stream.base() << ", " <<
+		    stream.bulks() << " bulks" << std::endl;
+		std::cout << std::endl;
 
-		// Open input file
-		fileStream.open(filename.c_str(), std::ifstream::binary);
+		if (planner && check_mode)
+		    throw std::runtime_error("A stream holds no image data to plan a verify-only job with.");
 
-		if (fileStream.is_open() == false)
+		// Before anything is erased
+		programmer.checkStream(stream);
+
+		if (!check_mode)
 		{
-		    throw std::runtime_error("Could not open file.");
+		    if (stream.erase() == ProgramStream::ERASE_CHIP)
+		    {
+			std::cout << "Chip erasing... " << std::flush;
+			programmer.eraseChip();
+			std::cout << "Done." << std::endl << std::flush;
+		    }
+		    else if (stream.erase() == ProgramStream::ERASE_SECTORS)
+		    {
+			std::cout << "Sector erasing... " << std::flush;
+			programmer.eraseSectors(stream.base(), stream.size());
+			std::cout << "Done." << std::endl << std::flush;
+		    }
+
+		    std::cout << "Checking chip status... " << std::flush;
+		    programmer.waitReady();
+		    std::cout << "Ready." << std::endl << std::flush;
+
+		    std::cout << "Programming... " << std::flush;
+		    programmer.program(stream);
+		    std::cout << "Done." << std::endl << std::flush;
 		}
 
-		struct stat stat_buf;
-		int rc = stat(filename.c_str(), &stat_buf);
-		int fileLength = (rc == 0) ? stat_buf.st_size : 0;
+		std::cout << "Verifying... " << std::flush;
+		programmer.verify(stream);
+		std::cout <<  "VERIFY OK. " << std::endl;
+	    }
+	    else if (patch_mode)
+	    {
+		std::vector<FlashProgrammer::PatchEdit> edits = loadPatch(patchSpecs, rw_offset);
 
-		std::cout << "File name: " << filename << std::endl;
-		std::cout << "File size: " << fileLength << " bytes" << std::endl;
-		std::cout << std::endl;
+		std::cout << "Patching " << edits.size() << " edits... " << std::flush;
+		FlashProgrammer::PatchResult patch = programmer.patch(edits);
+		std::cout << "Done." << std::endl;
+		std::cout << "Edits: " << patch.direct << " programmed in place, " << patch.rewritten <<
+		    " by rewriting " << patch.subsectors << " 4 kB subsectors, " << patch.unchanged <<
+		    " unchanged; " << patch.pagePrograms << " page programs." << std::endl;
+	    }
+	    else if (!test_mode)
+	    {
+		std::string filename(inputFilename);
+		FlashImage image;
+
+		// Read mode writes the file, there is no input to load
+		if (!read_mode)
+		{
+		    image = FlashImage::load(filename);
 
-		// Allocate memory for input file
-		fileBuffer = new char[fileLength];
+		    std::cout << "File name: " << filename << std::endl;
+		    std::cout << "File size: " << image.size() << " bytes, " << image.dataSize() << " bytes in " <<
+			image.ranges().size() << " non-blank ranges" << std::endl;
+		    std::cout << std::endl;
+		}
+		uint32_t fileLength = image.size();
 
-		// Read input file
-		fileStream.read(fileBuffer, fileLength);
-		fileStream.close();
+		// A verify-only plan compares against a flash that already holds the image
+		if (planner && check_mode)
+		{
+		    for (auto &range : image.ranges())
+		    {
+			planner->preload(rw_offset + range.offset, range.data.data(), range.data.size());
+		    }
+		}
 
 		// ---------------------------------------------------------
 		// Program
 		// ---------------------------------------------------------
 
-		if (!read_mode && !check_mode)
+		if (resume)
+		{
+		    // A plan must not touch the journal of a real interrupted run
+		    std::string journalPath = planner ? "" : journalFilename ? journalFilename : filename + ".journal";
+
+		    char jedecId[8];
+		    snprintf(jedecId, sizeof(jedecId), "%02x%02x%02x",
+			programmer.jedecId()[0], programmer.jedecId()[1], programmer.jedecId()[2]);
+
+		    // Resumable programming works on whole sectors of the image
+		    std::vector<uint8_t> fileBuffer = image.flatten();
+
+		    ProgressJournal journal(journalPath, sha256_hex(fileBuffer.data(), fileLength),
+			spi.getSerial(), jedecId, rw_offset);
+
+		    if (journal.load())
+		    {
+			std::cout << "Resuming from journal " << journalPath << std::endl;
+		    }
+		    journal.start();
+
+		    std::cout << "Programming sectors... " << std::flush;
+		    uint32_t skipped = programmer.programResumable(journal, rw_offset, fileBuffer.data(),
+			fileLength, !dont_erase);
+		    std::cout << "Done." << std::endl;
+
+		    if (skipped > 0)
+		    {
+			std::cout << "Resumed: " << skipped << " of " <<
+			    (((rw_offset + fileLength + 0xffff) & ~0xffff) - (rw_offset & ~0xffff)) / 0x10000 <<
+			    " sectors were already programmed." << std::endl;
+		    }
+
+		    journal.remove();
+		}
+		else if (registry_mode)
+		{
+		    if (registryFilename.empty())
+		    {
+			const char *home = getenv("HOME");
+			registryFilename = std::string(home != NULL ? home : ".") + "/.ftdiflash-registry";
+		    }
+
+		    std::string uniqueId = programmer.uniqueId();
+		    BoardRegistry registry(registryFilename);
+		    registry.open();
+
+		    std::cout << "Unique ID: " << uniqueId << std::endl;
+		    std::cout << "Programming changed sectors... " << std::flush;
+		    FlashProgrammer::DeltaResult delta = programmer.programDelta(registry, rw_offset, image, 4);
+		    std::cout << "Done." << std::endl;
+
+		    if (delta.outOfBand)
+		    {
+			std::cout << "Spot check found the flash changed outside the registry, all sectors were rewritten." <<
+			    std::endl;
+		    }
+		    std::cout << "Delta: " << delta.rewritten << " of " << delta.sectors << " sectors rewritten, " <<
+			delta.spotChecked << " unchanged sectors spot checked." << std::endl;
+		}
+		else if (!read_mode && !check_mode)
 		{		    
 		    if (!dont_erase)
 		    {
 		    	if (bulk_erase)
 		    	{
 			    std::cout << "Chip erasing... " << std::flush;
-			    spi.flash_write_enable();
-			    spi.flash_bulk_erase();
-			    spi.flash_wait(1000, 200000); // Probe every 1 sec for 200 seconds 
+			    programmer.eraseChip();
 			    std::cout << "Done." << std::endl << std::flush;
 			}
 			else
 			{			    
-			    int begin_addr = rw_offset & ~0xffff;
-			    int end_addr = (rw_offset + fileLength + 0xffff) & ~0xffff;
-
-			    uint32_t prog_cent = 0; // percentage progress
-
 			    std::cout << "Sector erasing... " << std::flush;
-			    for (int addr = begin_addr; addr < end_addr; addr += 0x10000)
-			    {
-				spi.flash_write_enable();
-				spi.flash_64kB_sector_erase(addr);
-				spi.flash_wait(150, blockEraseTime64k); // Probe every 150 ms for 2000 ms 
-
-				uint32_t new_cent = ((addr + 0x10000) * 100) / end_addr;
-				new_cent = new_cent - (new_cent % 10);
-				if (new_cent >= (prog_cent + 10))
-				{			  
-				    prog_cent = new_cent;
-				    std::cout << prog_cent << "% " << std::flush;
-				}
-			    }
+			    programmer.eraseSectors(rw_offset, fileLength);
 			    std::cout << "Done." << std::endl << std::flush;
 			}
 		    }
 
 		    std::cout << "Checking chip status... " << std::flush;
-		    spi.flash_wait(100, 1000);
+		    programmer.waitReady();
 		    std::cout << "Ready." << std::endl << std::flush;
 
 		    std::cout << "Programming... " << std::flush;
-
-		    uint32_t addr = 0;
-		    uint32_t bytes_left = fileLength;
-		    uint32_t buf_idx = 0;		    		    
-		    uint8_t buffer[256];
-		    
-		    uint32_t prog_cent = 0; // percentage progress
-
-		    while (bytes_left > 0)
-		    {
-			std::vector<uint8_t> bulkData;
-			for (int ipages = 0; bulkData.size() < 64 * 1024 && bytes_left > 0; ipages++)
-			{      
-			    int page_size = 256 - (rw_offset + addr) % 256;
-
-			    memcpy(buffer, &fileBuffer[buf_idx], page_size);
-			    spi.prepare_flash_prog(bulkData, rw_offset + addr, buffer, page_size, pageProgramTime);
-
-			    addr += page_size;
-			    buf_idx += page_size;
-			    bytes_left -= page_size;
-			}
-
-			spi.sendBulk(bulkData);
-			spi.flash_wait(50, 100);
-
-			uint32_t new_cent = ((fileLength - bytes_left) * 100) / fileLength;
-			new_cent = new_cent - (new_cent % 10);
-			if (new_cent >= (prog_cent + 10))
-			{			  
-			    prog_cent = new_cent;
-			    std::cout << prog_cent << "% " << std::flush;
-			}
-		    }
-
+		    programmer.program(rw_offset, image);
 		    std::cout << "Done." << std::endl << std::flush;
 		}
 
@@ -366,90 +975,76 @@ int main(int argc, char **argv)
 		// Read/Verify
 		// ---------------------------------------------------------
 
-		int bufferSize = 7 * 1024;
-
-		uint32_t prog_cent = 0; // percentage progress
-
 		if (read_mode)
 		{
-		    std::ofstream outputFile(inputFilename, std::ofstream::binary);
-		    if (outputFile.is_open() == false)
+		    // A plan must not overwrite the output file
+		    int outputFd = (to_stdout && !planner) ? STDOUT_FILENO :
+			open(planner ? "/dev/null" : inputFilename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		    if (outputFd < 0)
 		    {
 			throw std::runtime_error("Could not open file to write flash data.");
 		    }
+
+		    // USB reads and output writes overlap through the buffer's writer thread
+		    AsyncOutputBuffer outputBuffer(outputFd);
+		    std::ostream outputFile(&outputBuffer);
         	    std::cout << "Reading flash... " << std::flush;
-		    
-		    uint8_t buffer[bufferSize];
-		    for (int addr = 0; addr < read_size; addr += bufferSize)
-		    {			
-			uint32_t sizeToRead = bufferSize;
-			if (addr + bufferSize < read_size)
-			    sizeToRead = read_size - addr;
-
-			if (verbose)
-			{
-			    std::cout << "Read 0x" << std::setfill('0') << std::setw(6) << std::hex << rw_offset + addr <<
-				" +0x" << sizeToRead << "." << std::dec << std::endl;
-			}
 
-		    	spi.flash_read(rw_offset + addr, buffer, sizeToRead);
-			outputFile.write((const char *)buffer, sizeToRead);
-    		    }
-		    outputFile.close();
+		    if (dump_mode)
+		    {
+			FlashDumpWriter dump(outputFile, rw_offset, read_size);
+			programmer.read(rw_offset, read_size, [&dump](const uint8_t *data, uint32_t length) {
+			    dump.write(data, length);
+			});
+			dump.finish();
+			std::cout << "Done." << std::endl;
+			std::cout << "Dumped " << dump.dataSize() << " of " << read_size << " bytes in " <<
+			    dump.ranges() << " non-blank ranges." << std::endl;
+		    }
+		    else
+		    {
+			programmer.read(rw_offset, read_size, [&outputFile](const uint8_t *data, uint32_t length) {
+			    outputFile.write((const char *)data, length);
+			});
+			std::cout << "Done." << std::endl;
+		    }
+		    outputBuffer.finish();
+		    if (outputFd != STDOUT_FILENO)
+			close(outputFd);
 		}
-		else
+		else if (!resume && !registry_mode)
 		{
 		    std::cout << "Verifying... " << std::flush;
-
-		    uint8_t buffer_flash[bufferSize];
-		    for (int addr = 0; addr < fileLength; addr += bufferSize)
-		    {		
-			uint32_t sizeToRead = bufferSize;
-			if (addr + bufferSize > fileLength)
-			    sizeToRead = fileLength - addr;
-
-			if (verbose)
-			{
-			    std::cout << "Read 0x" << std::setfill('0') << std::setw(6) << std::hex << rw_offset + addr <<
-				" +0x" << sizeToRead << "." << std::dec << std::endl;
-			}
-
-			spi.flash_read(rw_offset + addr, buffer_flash, sizeToRead);
-
-			/*if (verbose)
-			{
-			    for (int i = 0; i < n; i++)
-			    {
-				fprintf(stderr, "%02x%c", data[i], i == n-1 || i % 32 == 31 ? '\n' : ' ');
-			    }
-			}*/
-
-			if (memcmp(fileBuffer + addr, buffer_flash, sizeToRead) != 0)
-			{
-			    throw std::runtime_error(Formatter() << "Found difference between flash and file at address " << addr << "!");
-			}
-
-			uint32_t new_cent = ((addr + bufferSize) * 100) / fileLength;
-			new_cent = new_cent - (new_cent % 10);
-			if (new_cent >= (prog_cent + 10))
-			{			  
-			    prog_cent = new_cent;
-			    std::cout << prog_cent << "% " << std::flush;
-			}
-		    }
-
+		    programmer.verify(rw_offset, image);
 		    std::cout <<  "VERIFY OK. " << std::endl;
 		}
 	    }
+	    if (fastDivisor != 0)
+	    {
+		const FlashProgrammer::ReadStats &stats = programmer.readStats();
+		std::cout << "Checked reads: " << stats.chunks << " chunks at " << spi.getClock() / fastDivisor <<
+		    " MHz, " << stats.fallbacks << " read again at " << spi.getClock() / spi.getDivisor() <<
+		    " MHz, " << stats.confirmed << " compared with it." << std::endl;
+		if (stats.fastFailed)
+		    std::cout << "Fast reads did not match the normal clock, finished at the normal clock." << std::endl;
+	    }
+
 	    // ---------------------------------------------------------
 	    // Reset
 	    // ---------------------------------------------------------
     
-	    spi.flash_power_down();
+	    if (!prog_sram)
+		programmer.powerDown();
 
-	    usleep(250000);
+	    spi.sleep_us(250000);
 
 	    std::cout << "Done." << std::endl << std::flush;
+
+	    if (planner)
+	    {
+		std::cout << std::endl;
+		planner->report(std::cout);
+	    }
 	}
 	catch (std::exception& e)
 	{
@@ -457,6 +1052,8 @@ int main(int argc, char **argv)
 	    std::cout << std::endl << "Make sure target board is ready to use e.g. watchdog is switched off, power is enabled." << std::endl;
 	    result = 1;
         }
-    
+
+	std::cout.rdbuf(coutBuffer);
+
 	return result;
 }
@@ -41,6 +41,21 @@ std::string ftdispi::getVersion()
     return m_version;
 }
 
+std::string ftdispi::getSerial()
+{
+    return m_serial;
+}
+
+uint8_t ftdispi::getCsBits()
+{
+    return m_cs_bits;
+}
+
+uint8_t ftdispi::getPinDir()
+{
+    return m_pindir;
+}
+
 uint32_t ftdispi::getDivisor()
 {
     return m_divisor;
@@ -79,6 +94,12 @@ void ftdispi::open(enum ftdi_interface ifnum, const char *devstr)
 
     m_ftdic_open = true;
 
+    char serial[128] = { };
+    if (ftdi_usb_get_strings2(m_ftdi, libusb_get_device(m_ftdi->usb_dev), nullptr, 0, nullptr, 0, serial, sizeof(serial)) == 0)
+    {
+	m_serial = serial;
+    }
+
     if (ftdi_usb_reset(m_ftdi))
     {
 	throw std::runtime_error(Formatter() << "Failed to reset FTDI USB device.");
@@ -142,6 +163,20 @@ void ftdispi::open(enum ftdi_interface ifnum, const char *devstr)
     set_read_chunksize(8 * 1024);
     set_write_chunksize(8 * 1024);
 
+    init_mpsse();
+}
+
+/* Opens a dry run: the command stream goes to the sink instead of a device. */
+void ftdispi::open(ftdisink *sink)
+{
+    m_sink = sink;
+    m_serial = "dry-run";
+
+    init_mpsse();
+}
+
+void ftdispi::init_mpsse()
+{
     /*
      * The 'H' chips can run with an internal clock of either 12 MHz or 60 MHz,
      * but the non-H chips can only run at 12 MHz. We enable the divide-by-5
@@ -185,121 +220,228 @@ void ftdispi::open(enum ftdi_interface ifnum, const char *devstr)
 
     write(ftdi_init, sizeof(ftdi_init), "Device init");
 
-    usleep(100000);
+    sleep_us(100000);
 }
 
-void ftdispi::flash_read_id(std::list<uint8_t> &id)
+void ftdispi::setPhase(const std::string &name)
 {
-    uint8_t ftdi_data_in[] = {
-        CHIP_SELECT,
-	DATA_OUT_IN(4),
-	0x9F,
-	0,
-	0,
-	0,
-	CHIP_DESELECT
-    };
-
-    write(ftdi_data_in, sizeof(ftdi_data_in), "Flash Read Id (w)");
+    if (m_sink != nullptr)
+    {
+	m_sink->phase(name);
+    }
+}
 
-    uint8_t ftdi_data_out[4] = { };
+void ftdispi::sleep_us(uint32_t us)
+{
+    if (m_sink != nullptr)
+    {
+	m_sink->sleep(us);
+    }
+    else
+    {
+	usleep(us);
+    }
+}
 
-    read(ftdi_data_out, sizeof(ftdi_data_out), "Flash Read Id (r)");
+void ftdispi::flash_read_id(std::list<uint8_t> &id)
+{
+    ftditransaction t(*this, "Flash Read Id");
+    ftdiresult_ptr result = flash_read_id(t);
+    t.flush();
 
-    for (int i = 1; i < (int)sizeof(ftdi_data_out); i++)
+    for (auto byte : result->data())
     {
-    	id.push_back(ftdi_data_out[i]);
+	id.push_back(byte);
     }
 }
 
+ftdiresult_ptr ftdispi::flash_read_id(ftditransaction &t)
+{
+    t.chip_select();
+    t.data_out({ 0x9F });
+    ftdiresult_ptr result = t.data_in(3);
+    t.chip_deselect();
+
+    return result;
+}
+
+/* Factory programmed 64-bit unique ID, after four dummy bytes. */
+void ftdispi::flash_read_unique_id(uint8_t id[8])
+{
+    ftditransaction t(*this, "Flash Read Unique Id");
+    ftdiresult_ptr result = flash_read_unique_id(t);
+    t.flush();
+
+    std::memcpy(id, result->data().data(), 8);
+}
+
+ftdiresult_ptr ftdispi::flash_read_unique_id(ftditransaction &t)
+{
+    t.chip_select();
+    t.data_out({ 0x4B, 0, 0, 0, 0 });
+    ftdiresult_ptr result = t.data_in(8);
+    t.chip_deselect();
+
+    return result;
+}
+
+ftdiresult_ptr ftdispi::flash_read_status(ftditransaction &t)
+{
+    t.chip_select();
+    t.data_out({ 0x05 });
+    ftdiresult_ptr result = t.data_in(1);
+    t.chip_deselect();
+
+    return result;
+}
+
+/* Status register 2; bit 7 (SUS) is set while an erase or program is suspended. */
+ftdiresult_ptr ftdispi::flash_read_status2(ftditransaction &t)
+{
+    t.chip_select();
+    t.data_out({ 0x35 });
+    ftdiresult_ptr result = t.data_in(1);
+    t.chip_deselect();
+
+    return result;
+}
+
 void ftdispi::flash_power_up()
 {
-    uint8_t ftdi_data[] = {
-    	CHIP_SELECT,
-	DATA_OUT(1),
-	0xAB,
-	CHIP_DESELECT
-    };
+    ftditransaction t(*this, "Flash power up");
+    flash_power_up(t);
+    t.flush();
+}
 
-    write(ftdi_data, sizeof(ftdi_data), "Flash power up");
+void ftdispi::flash_power_up(ftditransaction &t)
+{
+    t.chip_select();
+    t.data_out({ 0xAB });
+    t.chip_deselect();
+
+    // Release from power-down takes tRES1 = 3 us before the next command
+    flash_idle(t, 3);
 }
 
 void ftdispi::flash_power_down()
 {
-    uint8_t ftdi_data[] = {
-    	CHIP_SELECT,
-	DATA_OUT(1),
-	0xB9,
-	CHIP_DESELECT		
-    };
+    ftditransaction t(*this, "Flash power down");
+    flash_power_down(t);
+    t.flush();
+}
 
-    write(ftdi_data, sizeof(ftdi_data), "Flash power down");
+void ftdispi::flash_power_down(ftditransaction &t)
+{
+    t.chip_select();
+    t.data_out({ 0xB9 });
+    t.chip_deselect();
 }
 
 void ftdispi::flash_write_enable()
 {
-    uint8_t ftdi_data[] = {
-	CHIP_SELECT,
-	DATA_OUT(1),
-	0x06,
-	CHIP_DESELECT
-    };
+    ftditransaction t(*this, "Flash write enable");
+    flash_write_enable(t);
+    t.flush();
+}
 
-    write(ftdi_data, sizeof(ftdi_data), "Flash write enable");
+void ftdispi::flash_write_enable(ftditransaction &t)
+{
+    t.chip_select();
+    t.data_out({ 0x06 });
+    t.chip_deselect();
 }
 
 void ftdispi::flash_bulk_erase()
 {
-    uint8_t ftdi_data[] = {
-    	CHIP_SELECT,
-	DATA_OUT(1),
-	0xC7,
-	CHIP_DESELECT
-    };
+    ftditransaction t(*this, "Bulk erase");
+    flash_bulk_erase(t);
+    t.flush();
+}
 
-    write(ftdi_data, sizeof(ftdi_data), "Bulk erase");
+void ftdispi::flash_bulk_erase(ftditransaction &t)
+{
+    t.chip_select();
+    t.data_out({ 0xC7 });
+    t.chip_deselect();
 }
 
 void ftdispi::flash_64kB_sector_erase(int addr)
 {
-    uint8_t ftdi_data[] = {
-	CHIP_SELECT,
-	DATA_OUT(4),
+    ftditransaction t(*this, "Erase 64kB sector");
+    flash_64kB_sector_erase(t, addr);
+    t.flush();
+}
+
+void ftdispi::flash_64kB_sector_erase(ftditransaction &t, int addr)
+{
+    t.chip_select();
+    t.data_out({
 	0xD8,
 	(uint8_t)(addr >> 16),
 	(uint8_t)(addr >> 8),
-	(uint8_t)addr,
-	CHIP_DESELECT		
-    };
+	(uint8_t)addr
+    });
+    t.chip_deselect();
+}
 
-    write(ftdi_data, sizeof(ftdi_data), "Erase 64kB sector");
+void ftdispi::flash_4kB_subsector_erase(int addr)
+{
+    ftditransaction t(*this, "Erase 4kB subsector");
+    flash_4kB_subsector_erase(t, addr);
+    t.flush();
 }
 
-void ftdispi::flash_wait(int timeout, int duration)
+void ftdispi::flash_4kB_subsector_erase(ftditransaction &t, int addr)
 {
-    uint8_t ftdi_data_in[] = {
-        CHIP_SELECT,
-        DATA_OUT_IN(2),
-        0x05,
-        0,
-        CHIP_DESELECT,
-    };
+    t.chip_select();
+    t.data_out({
+	0x20,
+	(uint8_t)(addr >> 16),
+	(uint8_t)(addr >> 8),
+	(uint8_t)addr
+    });
+    t.chip_deselect();
+}
 
-    uint8_t ftdi_data_out[2] = { };
+/* Suspends the erase or program in progress; the flash stops within tSUS
+ * (20 us on W25Q) and then accepts reads. */
+void ftdispi::flash_suspend(ftditransaction &t)
+{
+    t.chip_select();
+    t.data_out({ 0x75 });
+    t.chip_deselect();
+    flash_idle(t, 20);
+}
+
+void ftdispi::flash_resume(ftditransaction &t)
+{
+    t.chip_select();
+    t.data_out({ 0x7A });
+    t.chip_deselect();
+}
+
+void ftdispi::flash_wait(int timeout, int duration)
+{
+    ftditransaction t(*this, "Wait");
+    flash_wait(t, timeout, duration);
+}
 
+/* Polls the status register until the flash is ready. The first poll goes out
+ * together with whatever is already queued on the transaction. */
+void ftdispi::flash_wait(ftditransaction &t, int timeout, int duration)
+{
     auto begin = std::chrono::high_resolution_clock::now();
 
     while (1)
     {
-	write(ftdi_data_in, sizeof(ftdi_data_in), "Wait");
-    	
-	read(ftdi_data_out, sizeof(ftdi_data_out), "Wait");
+	ftdiresult_ptr status = flash_read_status(t);
+	t.flush();
 
-	if ((ftdi_data_out[1] & 0x01) == 0)
+	if (((*status)[0] & 0x01) == 0)
 	    break;
 
-	usleep(timeout * 1000);
-	
+	sleep_us(timeout * 1000);
+
 	auto end = std::chrono::high_resolution_clock::now();
 	auto dur = end - begin;
 	auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(dur).count();
@@ -312,30 +454,28 @@ void ftdispi::flash_wait(int timeout, int duration)
 
 void ftdispi::flash_prog(int addr, uint8_t *page, int n)
 {
+    ftditransaction t(*this, "Flash prog");
+    flash_prog(t, addr, page, n);
+    t.flush();
+}
+
+void ftdispi::flash_prog(ftditransaction &t, int addr, const uint8_t *page, int n)
+{
+    flash_write_enable(t);
+
     uint8_t ftdi_data_begin[] = {
-	CHIP_SELECT,
-	DATA_OUT(1),
-	0x06,
-	CHIP_DESELECT,
-	CHIP_SELECT,
-	DATA_OUT(4 + n),
 	0x02,
 	(uint8_t)(addr >> 16),
 	(uint8_t)(addr >> 8),
 	(uint8_t)addr,
     };
 
-    uint8_t ftdi_data_end[] = {
-	CHIP_DESELECT
-    };
-    
-    uint8_t ftdi_data[sizeof(ftdi_data_begin) + n + sizeof(ftdi_data_end)];
-
-    std::memcpy(&ftdi_data[0], &ftdi_data_begin[0], sizeof(ftdi_data_begin));
-    std::memcpy(&ftdi_data[sizeof(ftdi_data_begin)], page, n);
-    std::memcpy(&ftdi_data[sizeof(ftdi_data_begin) + n], &ftdi_data_end[0], sizeof(ftdi_data_end));
+    std::vector<uint8_t> ftdi_data(ftdi_data_begin, ftdi_data_begin + sizeof(ftdi_data_begin));
+    ftdi_data.insert(ftdi_data.end(), page, page + n);
 
-    write(ftdi_data, sizeof(ftdi_data), "Flash prog");
+    t.chip_select();
+    t.data_out(ftdi_data.data(), ftdi_data.size());
+    t.chip_deselect();
 }
 
 void ftdispi::sendBulk(std::vector<uint8_t> &data)
@@ -345,71 +485,76 @@ void ftdispi::sendBulk(std::vector<uint8_t> &data)
 
 void ftdispi::prepare_flash_prog(std::vector<uint8_t> &data, int addr, uint8_t *page, int n, uint32_t pageProgramTime)
 {
-    uint8_t ftdi_data_begin[] = {
-	CHIP_SELECT,
-	DATA_OUT(1),
-	0x06,
-	CHIP_DESELECT,
-	CHIP_SELECT,
-	DATA_OUT(4 + n),
-	0x02,
-	(uint8_t)(addr >> 16),
-	(uint8_t)(addr >> 8),
-	(uint8_t)addr,
-    };
+    ftditransaction t(*this);
+    prepare_flash_prog(t, addr, page, n, pageProgramTime);
 
-    uint8_t ftdi_data_end[] = {
-	CHIP_DESELECT
-    };
-    
-    uint8_t ftdi_data[sizeof(ftdi_data_begin) + n + sizeof(ftdi_data_end)];
+    data.insert(data.end(), t.commands().begin(), t.commands().end());
+}
 
-    std::memcpy(&ftdi_data[0], &ftdi_data_begin[0], sizeof(ftdi_data_begin));
-    std::memcpy(&ftdi_data[sizeof(ftdi_data_begin)], page, n);
-    std::memcpy(&ftdi_data[sizeof(ftdi_data_begin) + n], &ftdi_data_end[0], sizeof(ftdi_data_end));
+/* Queues a page program followed by enough idle clocks for the page program
+ * time to elapse, so pages can be streamed back to back without polling. */
+void ftdispi::prepare_flash_prog(ftditransaction &t, int addr, const uint8_t *page, int n, uint32_t pageProgramTime)
+{
+    flash_prog(t, addr, page, n);
 
-    data.insert(data.end(), ftdi_data, ftdi_data + sizeof(ftdi_data));
+    flash_idle(t, pageProgramTime);
+}
 
-    int pageProgramWaitUs = pageProgramTime;
-    
+/* Queues idle clocks (CS deasserted) lasting at least the given time. */
+void ftdispi::flash_idle(ftditransaction &t, uint32_t us)
+{
+    t.wait_8_bits(idle_bytes(us));
+}
+
+/* Divisors are the even numbers from 2 to 131072, see init_mpsse(). */
+void ftdispi::check_divisor(uint32_t divisor)
+{
+    if (divisor < 2 || divisor > 131072 || divisor % 2 != 0)
+    {
+	throw std::runtime_error(Formatter() << "Invalid SPI clock divisor " << divisor << ".");
+    }
+}
+
+void ftdispi::set_clock_divisor(ftditransaction &t, uint32_t divisor)
+{
+    check_divisor(divisor);
+    t.command({ TCK_DIVISOR, (uint8_t)((divisor / 2 - 1) & 0xff), (uint8_t)(((divisor / 2 - 1) >> 8) & 0xff) });
+}
+
+/* Number of idle bytes to clock for at least the given time at the current SCK. */
+uint32_t ftdispi::idle_bytes(uint32_t us)
+{
     double spiBusClockHz = (getClock() / getDivisor()) * 1000000;
     double spiByteDurationUs = ((1 / spiBusClockHz) * 1000000) * 8;
-    
-    // Calculate number of max milliseconds to wait after programming page
-    int waitMaxCount = pageProgramWaitUs / ((spiByteDurationUs < 1) ? 1 : spiByteDurationUs);
 
-    uint8_t ftdi_data_wait[] = {
-	WAIT_8_BITS(waitMaxCount)
-    };
+    // Calculate number of bytes to clock for the requested time
+    int waitMaxCount = us / ((spiByteDurationUs < 1) ? 1 : spiByteDurationUs);
 
-    data.insert(data.end(), ftdi_data_wait, ftdi_data_wait + sizeof(ftdi_data_wait));    
+    return waitMaxCount + 1;
 }
 
 void ftdispi::flash_read(int addr, uint8_t *data, int n)
 {
-    uint8_t ftdi_data_begin[] = {
-	CHIP_SELECT,
-	DATA_OUT_IN(4 + n),
+    ftditransaction t(*this, "Flash read");
+    ftdiresult_ptr result = flash_read(t, addr, n);
+    t.flush();
+
+    std::memcpy(data, result->data().data(), n);
+}
+
+/* The address is clocked out and the data clocked in only, so no filler bytes
+ * travel over USB for the read. */
+ftdiresult_ptr ftdispi::flash_read(ftditransaction &t, int addr, int n)
+{
+    t.chip_select();
+    t.data_out({
 	0x03,
 	(uint8_t)(addr >> 16),
 	(uint8_t)(addr >> 8),
-	(uint8_t)addr,
-    };
-
-    uint8_t ftdi_data_end[] = {
-	CHIP_DESELECT
-    };
-
-    uint8_t ftdi_data[sizeof(ftdi_data_begin) + n + sizeof(ftdi_data_end)];
-
-    std::memcpy(&ftdi_data[0], &ftdi_data_begin[0], sizeof(ftdi_data_begin));
-    std::memset(&ftdi_data[sizeof(ftdi_data_begin)], 0xFF, n);
-    std::memcpy(&ftdi_data[sizeof(ftdi_data_begin) + n], &ftdi_data_end[0], sizeof(ftdi_data_end));
-
-    write(ftdi_data, sizeof(ftdi_data), "Flash read (w)");
-
-    std::memset(&ftdi_data[0], 0, sizeof(ftdi_data));
+	(uint8_t)addr
+    });
+    ftdiresult_ptr result = t.data_in(n);
+    t.chip_deselect();
 
-    read(ftdi_data, n + 4, "Flash read (r)");
-    std::memcpy(data, &ftdi_data[4], n);
+    return result;
 }
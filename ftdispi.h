@@ -11,17 +11,29 @@
 #include <unistd.h>
 
 #include "utils.h"
+#include "ftditransaction.h"
 
 #define DEFAULT_DIVISOR 18
 
+// iCE40 configuration pins on the low byte, see ftdispi::m_cs_bits
+#define ICE_CDONE 0x40
+#define ICE_CRESET 0x80
+
 #define DATA_OUT(n) 0x11, \
 		    (uint8_t)(n-1), \
 		    (uint8_t)((n-1) >> 8)
 
+#define DATA_IN(n) 0x20, \
+		    (uint8_t)(n-1), \
+		    (uint8_t)((n-1) >> 8)
+
 #define DATA_OUT_IN(n) 0x31, \
 		    (uint8_t)(n-1), \
 		    (uint8_t)((n-1) >> 8)
 
+#define DATA_BITS_OUT(n) 0x13, \
+		    (uint8_t)(n-1)
+
 #define WAIT_8_BITS(n) 0x8F, \
 		    (uint8_t)(n-1), \
 		    (uint8_t)((n-1) >> 8)
@@ -34,8 +46,25 @@
 		    m_cs_bits, \
 		    m_pindir
 
+/*
+ * Receives the command stream in place of the USB device, e.g. for dry runs.
+ * read() has to answer with the data the device would have returned.
+ */
+class ftdisink {
+
+public:
+    virtual ~ftdisink() {}
+
+    virtual void write(const uint8_t *data, size_t size, const std::string &operation_name) = 0;
+    virtual void read(uint8_t *data, size_t size, const std::string &operation_name) = 0;
+    virtual void sleep(uint32_t us) = 0;
+    virtual void phase(const std::string &name) = 0;
+};
+
 class ftdispi {
 
+    friend class ftditransaction;
+
 private:
     struct ftdi_context *m_ftdi = nullptr;
     bool m_ftdic_open = false;
@@ -43,6 +72,9 @@ private:
     // Driver version
     std::string m_version = "";
 
+    // USB serial number of the opened device
+    std::string m_serial = "";
+
     bool m_ftdic_latency_set = false;
     uint8_t m_ftdi_latency = 16;
 
@@ -57,12 +89,19 @@ private:
      * DI  is bit 2.
      * CS  is bit 3.
      *
+     * For iCE40 SRAM configuration two more pins are used: CDONE (bit 6) is read as input and
+     * CRESET_B (bit 7) is driven only while the FPGA is being configured.
+     *
      * The default values (set below) are used for most devices:
      *  value: 0x08  CS=high, DI=low, DO=low, SK=low
      *    dir: 0x0b  CS=output, DI=input, DO=output, SK=output
      */
     uint8_t m_cs_bits = 0x08;
     uint8_t m_pindir = 0x0b;
+
+    ftdisink *m_sink = nullptr;
+
+    void init_mpsse();
     
 public:
     ftdispi();
@@ -70,17 +109,27 @@ public:
     virtual ~ftdispi();
 
     std::string getVersion();
+    std::string getSerial();
+    uint8_t getCsBits();
+    uint8_t getPinDir();
     uint32_t getDivisor();
     double getClock();
 
     void open(enum ftdi_interface ifnum, const char *devstr);
+    void open(ftdisink *sink);
+
+    // Marks the start of a job phase (erase, program, ...) for the sink
+    void setPhase(const std::string &name);
+    void sleep_us(uint32_t us);
 
     void flash_read_id(std::list<uint8_t> &id);
+    void flash_read_unique_id(uint8_t id[8]);
     void flash_power_up();
     void flash_power_down();
     void flash_write_enable();
     void flash_bulk_erase();
     void flash_64kB_sector_erase(int addr);
+    void flash_4kB_subsector_erase(int addr);
 
     void flash_wait(int timeout, int duration);
     void flash_prog(int addr, uint8_t *page, int n);
@@ -90,9 +139,40 @@ public:
 
     void flash_read(int addr, uint8_t *data, int n);
 
+    // Queue the flash primitives on a transaction instead of sending them immediately
+    ftdiresult_ptr flash_read_id(ftditransaction &t);
+    ftdiresult_ptr flash_read_unique_id(ftditransaction &t);
+    ftdiresult_ptr flash_read_status(ftditransaction &t);
+    ftdiresult_ptr flash_read_status2(ftditransaction &t);
+    void flash_power_up(ftditransaction &t);
+    void flash_power_down(ftditransaction &t);
+    void flash_write_enable(ftditransaction &t);
+    void flash_bulk_erase(ftditransaction &t);
+    void flash_64kB_sector_erase(ftditransaction &t, int addr);
+    void flash_4kB_subsector_erase(ftditransaction &t, int addr);
+    void flash_suspend(ftditransaction &t);
+    void flash_resume(ftditransaction &t);
+
+    void flash_wait(ftditransaction &t, int timeout, int duration);
+    void flash_prog(ftditransaction &t, int addr, const uint8_t *page, int n);
+    void prepare_flash_prog(ftditransaction &t, int addr, const uint8_t *page, int n, uint32_t pageProgramTime);
+    void flash_idle(ftditransaction &t, uint32_t us);
+    // Changes SCK for the commands queued after it; idle times keep assuming getDivisor()
+    void set_clock_divisor(ftditransaction &t, uint32_t divisor);
+    static void check_divisor(uint32_t divisor);
+    uint32_t idle_bytes(uint32_t us);
+
+    ftdiresult_ptr flash_read(ftditransaction &t, int addr, int n);
+
 public:
     inline void write(uint8_t *data, size_t size, std::string operation_name)
     {
+	if (m_sink != nullptr)
+	{
+	    m_sink->write(data, size, operation_name);
+	    return;
+	}
+
 	int result = ftdi_write_data(m_ftdi, data, size);
 	if (result != (int)size)
 	{
@@ -115,6 +195,12 @@ public:
 
     inline void read(uint8_t *data, size_t size, std::string operation_name)
     {
+	if (m_sink != nullptr)
+	{
+	    m_sink->read(data, size, operation_name);
+	    return;
+	}
+
 	uint8_t *p_data = data;
 	int bytesToRead = size;
 	while (bytesToRead > 0)
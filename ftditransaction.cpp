@@ -0,0 +1,242 @@
+#include "ftditransaction.h"
+#include "ftdispi.h"
+
+#include <algorithm>
+#include <cstring>
+
+const size_t ftditransaction::max_segment_read;
+const size_t ftditransaction::max_segment_out_in;
+const size_t ftditransaction::max_cmd_after_read;
+
+const std::vector<uint8_t> &ftdiresult::data() const
+{
+    if (!m_ready)
+    {
+	throw std::runtime_error("Transaction result read before flush.");
+    }
+    return m_data;
+}
+
+ftditransaction::ftditransaction(ftdispi &spi, std::string name) :
+    m_spi(spi),
+    m_name(name),
+    m_cs_bits(spi.m_cs_bits),
+    m_pindir(spi.m_pindir)
+{
+}
+
+void ftditransaction::append(const uint8_t *cmd, size_t n)
+{
+    std::memcpy(reserve(n), cmd, n);
+}
+
+/* Returns how many of the n bytes can be read in the open segment, closing it
+ * first when it is already full. */
+size_t ftditransaction::begin_read(size_t n, size_t limit)
+{
+    if (m_segment_read + m_segment_cmd_after_read >= limit)
+    {
+	close_segment();
+    }
+
+    size_t len = std::min(n, limit - m_segment_read - m_segment_cmd_after_read);
+    m_segment_read += len;
+    m_read_total += len;
+    return len;
+}
+
+void ftditransaction::close_segment()
+{
+    if (m_segment_read == 0)
+	return;
+
+    m_cmd.push_back(SEND_IMMEDIATE);
+    m_segments.push_back({ m_cmd.size(), m_segment_read });
+    m_segment_read = 0;
+    m_segment_cmd_after_read = 0;
+}
+
+ftdiresult_ptr ftditransaction::add_result(size_t n)
+{
+    ftdiresult_ptr result = std::make_shared<ftdiresult>();
+    result->m_data.resize(n);
+    m_reads.push_back({ result, m_read_total });
+    return result;
+}
+
+void ftditransaction::chip_select()
+{
+    uint8_t cmd[] = {
+	CHIP_SELECT
+    };
+
+    append(cmd, sizeof(cmd));
+}
+
+void ftditransaction::chip_deselect()
+{
+    uint8_t cmd[] = {
+	CHIP_DESELECT
+    };
+
+    append(cmd, sizeof(cmd));
+}
+
+void ftditransaction::data_out(const uint8_t *data, size_t n)
+{
+    while (n > 0)
+    {
+	size_t len = std::min<size_t>(n, 0x10000);
+	std::vector<uint8_t> cmd = {
+	    DATA_OUT(len)
+	};
+
+	cmd.insert(cmd.end(), data, data + len);
+	append(cmd.data(), cmd.size());
+	data += len;
+	n -= len;
+    }
+}
+
+void ftditransaction::data_out(std::initializer_list<uint8_t> data)
+{
+    data_out(data.begin(), data.size());
+}
+
+ftdiresult_ptr ftditransaction::data_in(size_t n)
+{
+    ftdiresult_ptr result = add_result(n);
+    while (n > 0)
+    {
+	size_t len = begin_read(n, max_segment_read);
+	uint8_t cmd[] = {
+	    DATA_IN(len)
+	};
+
+	m_cmd.insert(m_cmd.end(), cmd, cmd + sizeof(cmd));
+	n -= len;
+    }
+    return result;
+}
+
+ftdiresult_ptr ftditransaction::data_out_in(const uint8_t *data, size_t n)
+{
+    ftdiresult_ptr result = add_result(n);
+    while (n > 0)
+    {
+	size_t len = begin_read(n, max_segment_out_in);
+	uint8_t cmd[] = {
+	    DATA_OUT_IN(len)
+	};
+
+	m_cmd.insert(m_cmd.end(), cmd, cmd + sizeof(cmd));
+	m_cmd.insert(m_cmd.end(), data, data + len);
+	data += len;
+	n -= len;
+    }
+    return result;
+}
+
+ftdiresult_ptr ftditransaction::data_out_in(std::initializer_list<uint8_t> data)
+{
+    return data_out_in(data.begin(), data.size());
+}
+
+void ftditransaction::wait_8_bits(size_t n)
+{
+    while (n > 0)
+    {
+	size_t len = std::min<size_t>(n, 0x10000);
+	uint8_t cmd[] = {
+	    WAIT_8_BITS(len)
+	};
+
+	append(cmd, sizeof(cmd));
+	n -= len;
+    }
+}
+
+void ftditransaction::set_bits_low(uint8_t value, uint8_t dir)
+{
+    uint8_t cmd[] = {
+	SET_BITS_LOW, value, dir
+    };
+
+    append(cmd, sizeof(cmd));
+}
+
+ftdiresult_ptr ftditransaction::get_bits_low()
+{
+    uint8_t cmd[] = {
+	GET_BITS_LOW
+    };
+
+    ftdiresult_ptr result = add_result(1);
+    begin_read(1, max_segment_read);
+    m_cmd.insert(m_cmd.end(), cmd, cmd + sizeof(cmd));
+    return result;
+}
+
+void ftditransaction::command(std::initializer_list<uint8_t> cmd)
+{
+    append(cmd.begin(), cmd.size());
+}
+
+uint8_t *ftditransaction::reserve(size_t n)
+{
+    if (m_segment_read > 0)
+    {
+	if (m_segment_cmd_after_read + n > max_cmd_after_read)
+	{
+	    close_segment();
+	}
+	else
+	{
+	    m_segment_cmd_after_read += n;
+	}
+    }
+
+    size_t offset = m_cmd.size();
+    m_cmd.resize(offset + n);
+    return &m_cmd[offset];
+}
+
+void ftditransaction::flush()
+{
+    close_segment();
+
+    std::vector<uint8_t> data_in(m_read_total);
+
+    size_t cmd_begin = 0;
+    size_t read_begin = 0;
+    for (auto &seg : m_segments)
+    {
+	m_spi.write(&m_cmd[cmd_begin], seg.cmd_end - cmd_begin, m_name + " (w)");
+	m_spi.read(&data_in[read_begin], seg.read_size, m_name + " (r)");
+	cmd_begin = seg.cmd_end;
+	read_begin += seg.read_size;
+    }
+
+    if (cmd_begin < m_cmd.size())
+    {
+	m_spi.write(&m_cmd[cmd_begin], m_cmd.size() - cmd_begin, m_name);
+    }
+
+    for (auto &read : m_reads)
+    {
+	std::memcpy(read.result->m_data.data(), &data_in[read.offset], read.result->m_data.size());
+	read.result->m_ready = true;
+    }
+
+    clear();
+}
+
+void ftditransaction::clear()
+{
+    m_cmd.clear();
+    m_segments.clear();
+    m_reads.clear();
+    m_segment_read = 0;
+    m_segment_cmd_after_read = 0;
+    m_read_total = 0;
+}
@@ -0,0 +1,118 @@
+#ifndef FTDI_TRANSACTION_H
+#define FTDI_TRANSACTION_H
+
+#include <cstdint>
+#include <cstddef>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <vector>
+
+class ftdispi;
+
+/*
+ * Deferred result of a read queued on an ftditransaction. The data becomes
+ * available once the transaction owning the read has been flushed.
+ */
+class ftdiresult {
+
+public:
+    bool ready() const                  { return m_ready; }
+    size_t size() const                 { return m_data.size(); }
+
+    const std::vector<uint8_t> &data() const;
+    uint8_t operator [] (size_t index) const { return data()[index]; }
+
+private:
+    friend class ftditransaction;
+
+    std::vector<uint8_t> m_data;
+    bool m_ready = false;
+};
+
+typedef std::shared_ptr<ftdiresult> ftdiresult_ptr;
+
+/*
+ * MPSSE transaction builder. Operations (chip select, data out/in, idle clocks,
+ * GPIO) are queued into one command buffer and sent by flush() in as few USB
+ * transfers as possible. Reads return ftdiresult handles filled in by flush().
+ *
+ * The command buffer is split into segments only where the host has to collect
+ * read data: SEND_IMMEDIATE is placed at the end of such segments only, so
+ * write-only sequences always go out in a single transfer.
+ */
+class ftditransaction {
+
+private:
+    struct segment
+    {
+	size_t cmd_end;
+	size_t read_size;
+    };
+
+    struct pending_read
+    {
+	ftdiresult_ptr result;
+	size_t offset;
+    };
+
+    ftdispi &m_spi;
+    std::string m_name;
+
+    uint8_t m_cs_bits;
+    uint8_t m_pindir;
+
+    std::vector<uint8_t> m_cmd;
+    std::vector<segment> m_segments;
+    std::vector<pending_read> m_reads;
+
+    // Read bytes and commands queued behind them in the open segment
+    size_t m_segment_read = 0;
+    size_t m_segment_cmd_after_read = 0;
+    size_t m_read_total = 0;
+
+    /* The MPSSE stops consuming commands while its receive buffer is full, so
+     * a segment is closed once its reads or the commands queued behind them
+     * grow large enough to stall the write. Clocking data out and in at the
+     * same time keeps the historic 7 kB limit of flash_read(). */
+    static const size_t max_segment_read = 64 * 1024;
+    static const size_t max_segment_out_in = 7 * 1024;
+    static const size_t max_cmd_after_read = 2 * 1024;
+
+    void append(const uint8_t *cmd, size_t n);
+    size_t begin_read(size_t n, size_t limit);
+    void close_segment();
+    ftdiresult_ptr add_result(size_t n);
+
+public:
+    ftditransaction(ftdispi &spi, std::string name = "Transaction");
+
+    void chip_select();
+    void chip_deselect();
+
+    void data_out(const uint8_t *data, size_t n);
+    void data_out(std::initializer_list<uint8_t> data);
+    ftdiresult_ptr data_in(size_t n);
+    ftdiresult_ptr data_out_in(const uint8_t *data, size_t n);
+    ftdiresult_ptr data_out_in(std::initializer_list<uint8_t> data);
+
+    void wait_8_bits(size_t n);
+
+    void set_bits_low(uint8_t value, uint8_t dir);
+    ftdiresult_ptr get_bits_low();
+
+    void command(std::initializer_list<uint8_t> cmd);
+
+    // Space for n bytes of complete MPSSE commands without reads, to be filled in by the caller
+    uint8_t *reserve(size_t n);
+
+    bool empty() const                  { return m_cmd.empty(); }
+    size_t size() const                 { return m_cmd.size(); }
+    size_t read_size() const            { return m_read_total; }
+    const std::vector<uint8_t> &commands() const { return m_cmd; }
+
+    void flush();
+    void clear();
+};
+
+#endif // FTDI_TRANSACTION_H
@@ -0,0 +1,130 @@
+#include "journal.h"
+#include "utils.h"
+
+#include <fstream>
+#include <stdexcept>
+#include <unistd.h>
+
+static const char *journalMagic = "ftdiflash-journal 1";
+
+ProgressJournal::ProgressJournal(const std::string &path, const std::string &imageHash, const std::string &serial,
+    const std::string &jedecId, uint32_t offset) :
+    m_path(path),
+    m_file(nullptr)
+{
+    m_key = Formatter() << "image=" << imageHash << " serial=" << (serial.empty() ? "-" : serial) <<
+	" jedec=" << jedecId << " offset=" << offset;
+}
+
+ProgressJournal::~ProgressJournal()
+{
+    if (m_file != nullptr)
+    {
+	fclose(m_file);
+    }
+}
+
+/* Loads the journal from disk. Returns false if there is no journal or it
+ * belongs to a different image, programmer or flash. */
+bool ProgressJournal::load()
+{
+    std::ifstream in(m_path.c_str());
+    if (!in.is_open())
+	return false;
+
+    std::string line;
+    if (!std::getline(in, line) || line != journalMagic)
+	return false;
+    if (!std::getline(in, line) || line != m_key)
+	return false;
+
+    while (std::getline(in, line))
+    {
+	char record = 0;
+	unsigned int addr = 0;
+	unsigned int crc = 0;
+
+	// A torn last line from an interrupted run is simply ignored
+	if (sscanf(line.c_str(), "%c %x %x", &record, &addr, &crc) < 2)
+	    continue;
+
+	if (record == 'E')
+	{
+	    m_erased.insert(addr);
+	}
+	else if (record == 'V')
+	{
+	    m_verified[addr] = crc;
+	}
+    }
+    return true;
+}
+
+/* Opens the journal for appending, starting a new one unless load() succeeded. */
+void ProgressJournal::start()
+{
+    bool resume = !m_erased.empty() || !m_verified.empty();
+    if (m_path.empty())
+	return;
+
+    m_file = fopen(m_path.c_str(), resume ? "a" : "w");
+    if (m_file == nullptr)
+    {
+	throw std::runtime_error(Formatter() << "Could not open journal file " << m_path << ".");
+    }
+
+    if (!resume)
+    {
+	fprintf(m_file, "%s\n%s\n", journalMagic, m_key.c_str());
+	fflush(m_file);
+	fsync(fileno(m_file));
+    }
+}
+
+void ProgressJournal::remove()
+{
+    if (m_file != nullptr)
+    {
+	fclose(m_file);
+	m_file = nullptr;
+    }
+    if (!m_path.empty())
+	unlink(m_path.c_str());
+}
+
+bool ProgressJournal::erased(uint32_t addr) const
+{
+    return m_erased.count(addr) != 0 || m_verified.count(addr) != 0;
+}
+
+bool ProgressJournal::verified(uint32_t addr, uint32_t &crc) const
+{
+    auto it = m_verified.find(addr);
+    if (it == m_verified.end())
+	return false;
+
+    crc = it->second;
+    return true;
+}
+
+void ProgressJournal::markErased(uint32_t addr)
+{
+    m_erased.insert(addr);
+    append("E", addr, 0);
+}
+
+void ProgressJournal::markVerified(uint32_t addr, uint32_t crc)
+{
+    m_verified[addr] = crc;
+    append("V", addr, crc);
+}
+
+void ProgressJournal::append(const char *record, uint32_t addr, uint32_t crc)
+{
+    if (m_file == nullptr)
+	return;
+
+    fprintf(m_file, "%s %06x %08x\n", record, addr, crc);
+    fflush(m_file);
+    fsync(fileno(m_file));
+}
@@ -0,0 +1,50 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <set>
+#include <string>
+
+/*
+ * On-disk progress journal for resumable programming. The journal is keyed by
+ * the image hash, the programmer serial number, the flash JEDEC ID and the
+ * write offset; records are appended and synced as each sector completes, so
+ * a run interrupted at any point can be continued with --resume. With an
+ * empty path the journal is kept in memory only.
+ */
+class ProgressJournal
+{
+public:
+    ProgressJournal(const std::string &path, const std::string &imageHash, const std::string &serial,
+	const std::string &jedecId, uint32_t offset);
+    ~ProgressJournal();
+
+    bool load();
+    void start();
+    void remove();
+
+    bool erased(uint32_t addr) const;
+    bool verified(uint32_t addr, uint32_t &crc) const;
+
+    void markErased(uint32_t addr);
+    void markVerified(uint32_t addr, uint32_t crc);
+
+    const std::string &path() const { return m_path; }
+
+private:
+    std::string m_path;
+    std::string m_key;
+    FILE *m_file;
+
+    std::set<uint32_t> m_erased;
+    std::map<uint32_t, uint32_t> m_verified;
+
+    void append(const char *record, uint32_t addr, uint32_t crc);
+
+    ProgressJournal(const ProgressJournal &);
+    ProgressJournal & operator = (ProgressJournal &);
+};
+
+#endif // JOURNAL_H
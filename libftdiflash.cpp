@@ -0,0 +1,257 @@
+#include "libftdiflash.h"
+#include "flashprogrammer.h"
+
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+
+struct ftdiflash
+{
+    FlashProgrammer programmer;
+
+    // Sync calls may come from several threads, each gets its own error
+    std::mutex errorMutex;
+    std::map<std::thread::id, std::string> errors;
+
+    // Jobs not freed yet; ftdiflash_free() waits for them
+    std::mutex jobsMutex;
+    std::set<ftdiflash_job_t *> jobs;
+};
+
+struct ftdiflash_job
+{
+    ftdiflash_t *flash;
+    std::future<void> result;
+    bool finished = false;
+    std::string error;
+};
+
+static void setError(ftdiflash_t *flash, const char *error)
+{
+    std::lock_guard<std::mutex> lock(flash->errorMutex);
+    flash->errors[std::this_thread::get_id()] = error;
+}
+
+template <typename Function>
+static int call(ftdiflash_t *flash, Function function)
+{
+    try
+    {
+	function();
+	return 0;
+    }
+    catch (std::exception &e)
+    {
+	setError(flash, e.what());
+	return -1;
+    }
+}
+
+template <typename Function>
+static ftdiflash_job_t *start(ftdiflash_t *flash, Function function)
+{
+    try
+    {
+	std::unique_ptr<ftdiflash_job_t> job(new ftdiflash_job());
+	job->flash = flash;
+	job->result = function();
+
+	std::lock_guard<std::mutex> lock(flash->jobsMutex);
+	flash->jobs.insert(job.get());
+	return job.release();
+    }
+    catch (std::exception &e)
+    {
+	setError(flash, e.what());
+	return nullptr;
+    }
+}
+
+ftdiflash_t *ftdiflash_new(void)
+{
+    try
+    {
+	return new ftdiflash();
+    }
+    catch (std::exception &)
+    {
+	return nullptr;
+    }
+}
+
+/* Jobs outlive the handle: they keep their result and can still be waited
+ * for and freed afterwards. */
+void ftdiflash_free(ftdiflash_t *flash)
+{
+    if (flash == nullptr)
+	return;
+
+    {
+	std::lock_guard<std::mutex> lock(flash->jobsMutex);
+	for (auto job : flash->jobs)
+	{
+	    job->result.wait();
+	    job->flash = nullptr;
+	}
+    }
+    delete flash;
+}
+
+const char *ftdiflash_error(ftdiflash_t *flash)
+{
+    std::lock_guard<std::mutex> lock(flash->errorMutex);
+    return flash->errors[std::this_thread::get_id()].c_str();
+}
+
+void ftdiflash_set_progress(ftdiflash_t *flash, ftdiflash_progress_cb callback, void *user)
+{
+    if (callback == nullptr)
+    {
+	flash->programmer.setProgressCallback(nullptr);
+	return;
+    }
+
+    flash->programmer.setProgressCallback([callback, user](const std::string &phase, uint32_t done, uint32_t total) {
+	callback(user, phase.c_str(), done, total);
+    });
+}
+
+void ftdiflash_set_erase_suspend(ftdiflash_t *flash, int enable)
+{
+    flash->programmer.setEraseSuspend(enable != 0);
+}
+
+int ftdiflash_open(ftdiflash_t *flash, char interface, const char *devstr)
+{
+    return call(flash, [&]() {
+	if (interface < 'A' || interface > 'D')
+	    throw std::runtime_error("Invalid FTDI interface.");
+
+	flash->programmer.open((enum ftdi_interface)(INTERFACE_A + interface - 'A'), devstr);
+    });
+}
+
+int ftdiflash_identify(ftdiflash_t *flash, uint8_t jedec_id[3], uint32_t *size)
+{
+    return call(flash, [&]() {
+	const FlashConfig *config = flash->programmer.identify();
+	if (jedec_id != nullptr)
+	    std::memcpy(jedec_id, flash->programmer.jedecId(), 3);
+	if (config == nullptr)
+	    throw std::runtime_error("Unknown flash memory.");
+	if (size != nullptr)
+	    *size = config->size;
+    });
+}
+
+int ftdiflash_erase_chip(ftdiflash_t *flash)
+{
+    return call(flash, [&]() { flash->programmer.eraseChip(); });
+}
+
+int ftdiflash_erase(ftdiflash_t *flash, uint32_t addr, uint32_t length)
+{
+    return call(flash, [&]() { flash->programmer.eraseSectors(addr, length); });
+}
+
+int ftdiflash_program(ftdiflash_t *flash, uint32_t addr, const uint8_t *data, uint32_t length)
+{
+    return call(flash, [&]() { flash->programmer.program(addr, data, length); });
+}
+
+int ftdiflash_read(ftdiflash_t *flash, uint32_t addr, uint8_t *data, uint32_t length)
+{
+    return call(flash, [&]() { flash->programmer.read(addr, data, length); });
+}
+
+int ftdiflash_verify(ftdiflash_t *flash, uint32_t addr, const uint8_t *data, uint32_t length)
+{
+    return call(flash, [&]() { flash->programmer.verify(addr, data, length); });
+}
+
+int ftdiflash_power_down(ftdiflash_t *flash)
+{
+    return call(flash, [&]() { flash->programmer.powerDown(); });
+}
+
+ftdiflash_job_t *ftdiflash_erase_chip_async(ftdiflash_t *flash)
+{
+    return start(flash, [&]() { return flash->programmer.eraseChipAsync(); });
+}
+
+ftdiflash_job_t *ftdiflash_erase_async(ftdiflash_t *flash, uint32_t addr, uint32_t length)
+{
+    return start(flash, [&]() { return flash->programmer.eraseSectorsAsync(addr, length); });
+}
+
+ftdiflash_job_t *ftdiflash_program_async(ftdiflash_t *flash, uint32_t addr, const uint8_t *data, uint32_t length)
+{
+    return start(flash, [&]() {
+	return flash->programmer.programAsync(addr, std::vector<uint8_t>(data, data + length));
+    });
+}
+
+ftdiflash_job_t *ftdiflash_read_async(ftdiflash_t *flash, uint32_t addr, uint8_t *data, uint32_t length)
+{
+    FlashProgrammer *programmer = &flash->programmer;
+    return start(flash, [&]() {
+	return std::async(std::launch::async, [programmer, addr, data, length]() {
+	    programmer->read(addr, data, length);
+	});
+    });
+}
+
+ftdiflash_job_t *ftdiflash_verify_async(ftdiflash_t *flash, uint32_t addr, const uint8_t *data, uint32_t length)
+{
+    return start(flash, [&]() {
+	return flash->programmer.verifyAsync(addr, std::vector<uint8_t>(data, data + length));
+    });
+}
+
+int ftdiflash_job_done(ftdiflash_job_t *job)
+{
+    if (job->finished)
+	return 1;
+
+    return job->result.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+int ftdiflash_job_wait(ftdiflash_job_t *job)
+{
+    if (!job->finished)
+    {
+	job->finished = true;
+	try
+	{
+	    job->result.get();
+	}
+	catch (std::exception &e)
+	{
+	    job->error = e.what();
+	}
+    }
+    return job->error.empty() ? 0 : -1;
+}
+
+const char *ftdiflash_job_error(ftdiflash_job_t *job)
+{
+    return job->error.c_str();
+}
+
+void ftdiflash_job_free(ftdiflash_job_t *job)
+{
+    if (job != nullptr)
+    {
+	ftdiflash_job_wait(job);
+	if (job->flash != nullptr)
+	{
+	    std::lock_guard<std::mutex> lock(job->flash->jobsMutex);
+	    job->flash->jobs.erase(job);
+	}
+	delete job;
+    }
+}
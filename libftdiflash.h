@@ -0,0 +1,66 @@
+#ifndef LIBFTDIFLASH_H
+#define LIBFTDIFLASH_H
+
+/*
+ * C interface of the ftdiflash library. All functions returning int return 0
+ * on success and -1 on failure; ftdiflash_error() and ftdiflash_job_error()
+ * then describe the failure. A handle may be used from several threads at
+ * once; calls on it run one after another.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ftdiflash ftdiflash_t;
+typedef struct ftdiflash_job ftdiflash_job_t;
+
+/* Called from the thread running the job. */
+typedef void (*ftdiflash_progress_cb)(void *user, const char *phase, uint32_t done, uint32_t total);
+
+ftdiflash_t *ftdiflash_new(void);
+/* Waits for the jobs still running on the handle; they have to be freed
+ * with ftdiflash_job_free() as usual. */
+void ftdiflash_free(ftdiflash_t *flash);
+/* The last failure of a call on the handle from the calling thread; valid
+ * until that thread's next failure. */
+const char *ftdiflash_error(ftdiflash_t *flash);
+
+void ftdiflash_set_progress(ftdiflash_t *flash, ftdiflash_progress_cb callback, void *user);
+/* Nonzero: reads from other threads suspend a running erase instead of waiting for it. */
+void ftdiflash_set_erase_suspend(ftdiflash_t *flash, int enable);
+
+/* interface: 'A' to 'D'; devstr: libftdi device string or NULL for the first FT2232H */
+int ftdiflash_open(ftdiflash_t *flash, char interface, const char *devstr);
+int ftdiflash_identify(ftdiflash_t *flash, uint8_t jedec_id[3], uint32_t *size);
+
+int ftdiflash_erase_chip(ftdiflash_t *flash);
+int ftdiflash_erase(ftdiflash_t *flash, uint32_t addr, uint32_t length);
+int ftdiflash_program(ftdiflash_t *flash, uint32_t addr, const uint8_t *data, uint32_t length);
+int ftdiflash_read(ftdiflash_t *flash, uint32_t addr, uint8_t *data, uint32_t length);
+int ftdiflash_verify(ftdiflash_t *flash, uint32_t addr, const uint8_t *data, uint32_t length);
+int ftdiflash_power_down(ftdiflash_t *flash);
+
+/* Asynchronous jobs. Program and verify data is copied; read data must stay
+ * valid until the job has finished. */
+ftdiflash_job_t *ftdiflash_erase_chip_async(ftdiflash_t *flash);
+ftdiflash_job_t *ftdiflash_erase_async(ftdiflash_t *flash, uint32_t addr, uint32_t length);
+ftdiflash_job_t *ftdiflash_program_async(ftdiflash_t *flash, uint32_t addr, const uint8_t *data, uint32_t length);
+ftdiflash_job_t *ftdiflash_read_async(ftdiflash_t *flash, uint32_t addr, uint8_t *data, uint32_t length);
+ftdiflash_job_t *ftdiflash_verify_async(ftdiflash_t *flash, uint32_t addr, const uint8_t *data, uint32_t length);
+
+/* Returns 1 once the job has finished, 0 while it is running. */
+int ftdiflash_job_done(ftdiflash_job_t *job);
+int ftdiflash_job_wait(ftdiflash_job_t *job);
+const char *ftdiflash_job_error(ftdiflash_job_t *job);
+/* Waits for the job to finish before releasing it. */
+void ftdiflash_job_free(ftdiflash_job_t *job);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LIBFTDIFLASH_H
@@ -0,0 +1,494 @@
+#include "planner.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include <stdexcept>
+
+constexpr double JobPlanner::usb_transfer_us;
+constexpr double JobPlanner::usb_bytes_per_us;
+constexpr double JobPlanner::usb_read_round_trip_us;
+constexpr size_t JobPlanner::usb_chunk_size;
+constexpr double JobPlanner::subsector_erase_us;
+
+JobPlanner::JobPlanner(const FlashConfig &config, uint8_t cs_bits) :
+    m_config(config),
+    m_cs_bits(cs_bits),
+    m_flash(config.size, 0xFF),
+    m_nandCache(config.nandPageSize, 0xFF)
+{
+    phase("Init");
+}
+
+JobPlanner::Phase &JobPlanner::current()
+{
+    return m_phases[m_current];
+}
+
+void JobPlanner::phase(const std::string &name)
+{
+    for (size_t i = 0; i < m_phases.size(); i++)
+    {
+	if (m_phases[i].name == name)
+	{
+	    m_current = i;
+	    return;
+	}
+    }
+
+    m_phases.push_back(Phase());
+    m_current = m_phases.size() - 1;
+    current().name = name;
+}
+
+void JobPlanner::advance(double us)
+{
+    m_now += us;
+    current().us += us;
+}
+
+void JobPlanner::preload(uint32_t addr, const uint8_t *data, size_t size)
+{
+    size = std::min(size, m_flash.size() - std::min<size_t>(addr, m_flash.size()));
+    std::memcpy(&m_flash[addr], data, size);
+}
+
+void JobPlanner::write(const uint8_t *data, size_t size, const std::string &)
+{
+    size_t transfers = (size + usb_chunk_size - 1) / usb_chunk_size;
+
+    current().writes++;
+    current().bytesOut += size;
+    advance(transfers * usb_transfer_us + size / usb_bytes_per_us);
+
+    execute(data, size);
+}
+
+void JobPlanner::read(uint8_t *data, size_t size, const std::string &operation_name)
+{
+    if (size > m_rx.size())
+    {
+	throw std::runtime_error(operation_name + ". Plan reads more data than the commands return.");
+    }
+
+    current().reads++;
+    current().bytesIn += size;
+    advance(usb_read_round_trip_us + size / usb_bytes_per_us);
+
+    std::memcpy(data, m_rx.data(), size);
+    m_rx.erase(m_rx.begin(), m_rx.begin() + size);
+}
+
+void JobPlanner::sleep(uint32_t us)
+{
+    current().sleepUs += us;
+    advance(us);
+}
+
+void JobPlanner::setBusy(double us)
+{
+    m_busyUntil = m_now + us;
+    current().busyUs += us;
+}
+
+/* Clocks one byte through the simulated flash and returns the byte it drives on DO. */
+uint8_t JobPlanner::spiByte(uint8_t out)
+{
+    advance(m_byteUs);
+
+    if (!m_selected)
+	return 0xFF;
+
+    size_t pos = m_spiCmd.size();
+    m_spiCmd.push_back(out);
+
+    bool busy = m_now < m_busyUntil;
+    uint8_t op = m_spiCmd[0];
+
+    if (m_config.nandPageSize != 0)
+	return nandByte(pos);
+
+    if (m_poweredDown && op != 0xAB)
+	return 0xFF;
+
+    switch (op)
+    {
+    case 0x9F:
+	if (pos == 1) return m_config.manufacturerId;
+	if (pos == 2) return m_config.ID15_ID8;
+	if (pos == 3) return m_config.ID7_ID0;
+	break;
+    case 0x05:
+	if (pos >= 1)
+	{
+	    if (pos == 1)
+		current().polls++;
+	    return (busy ? 0x01 : 0x00) | (m_writeEnabled ? 0x02 : 0x00);
+	}
+	break;
+    case 0x35:
+	if (pos >= 1)
+	    return m_suspendedUs > 0 ? 0x80 : 0x00;
+	break;
+    case 0x03:
+	if (pos >= 4 && !busy)
+	{
+	    uint32_t addr = (m_spiCmd[1] << 16) | (m_spiCmd[2] << 8) | m_spiCmd[3];
+	    return m_flash[(addr + pos - 4) % m_flash.size()];
+	}
+	break;
+    }
+    return 0xFF;
+}
+
+/* SPI NAND: reads go through the page cache, or stream from the flash in the
+ * continuous read mode. Spare bytes read as erased. */
+uint8_t JobPlanner::nandByte(size_t pos)
+{
+    bool busy = m_now < m_busyUntil;
+
+    switch (m_spiCmd[0])
+    {
+    case 0x9F:
+	if (pos == 2) return m_config.manufacturerId;
+	if (pos == 3) return m_config.ID15_ID8;
+	if (pos == 4) return m_config.ID7_ID0;
+	break;
+    case 0x0F:
+	if (pos < 2)
+	    break;
+	if (m_spiCmd[1] == 0xA0)
+	    return m_nandProtection;
+	if (m_spiCmd[1] == 0xB0)
+	    return m_nandConfig;
+	if (pos == 2)
+	    current().polls++;
+	return (busy ? 0x01 : 0x00) | (m_writeEnabled ? 0x02 : 0x00);
+    case 0x03:
+	if (pos < 4 || busy)
+	    break;
+	if (m_nandConfig & 0x08)
+	{
+	    uint32_t column = ((m_spiCmd[1] << 8) | m_spiCmd[2]) + pos - 4;
+	    return column < m_nandCache.size() ? m_nandCache[column] : 0xFF;
+	}
+	return m_flash[((uint64_t)m_nandPage * m_config.nandPageSize + pos - 4) % m_flash.size()];
+    }
+    return 0xFF;
+}
+
+void JobPlanner::nandDeselect()
+{
+    uint8_t op = m_spiCmd[0];
+    uint32_t pageSize = m_config.nandPageSize;
+    uint32_t page = 0;
+    if (m_spiCmd.size() >= 4)
+    {
+	page = ((m_spiCmd[2] << 8) | m_spiCmd[3]) % (m_flash.size() / pageSize);
+    }
+
+    if (op == 0xFF)
+    {
+	m_nandProtection = 0x7C;
+	m_nandConfig = 0x18;
+	m_writeEnabled = false;
+	setBusy(500);
+    }
+    else if (m_now < m_busyUntil)
+    {
+	// Commands other than status reads are ignored while busy
+    }
+    else if (op == 0x1F && m_spiCmd.size() == 3)
+    {
+	if (m_spiCmd[1] == 0xA0)
+	    m_nandProtection = m_spiCmd[2];
+	else if (m_spiCmd[1] == 0xB0)
+	    m_nandConfig = m_spiCmd[2];
+    }
+    else if (op == 0x06)
+    {
+	m_writeEnabled = true;
+    }
+    else if (op == 0x13 && m_spiCmd.size() == 4)
+    {
+	std::memcpy(m_nandCache.data(), &m_flash[(size_t)page * pageSize], pageSize);
+	m_nandPage = page;
+	setBusy(60);
+    }
+    else if (op == 0x02 && m_spiCmd.size() > 3)
+    {
+	// Program load clears the rest of the cache
+	uint32_t column = (m_spiCmd[1] << 8) | m_spiCmd[2];
+	std::fill(m_nandCache.begin(), m_nandCache.end(), 0xFF);
+	for (size_t i = 3; i < m_spiCmd.size() && column + i - 3 < pageSize; i++)
+	    m_nandCache[column + i - 3] = m_spiCmd[i];
+    }
+    else if (m_writeEnabled && op == 0x10 && m_spiCmd.size() == 4)
+    {
+	for (uint32_t i = 0; i < pageSize; i++)
+	    m_flash[(size_t)page * pageSize + i] &= m_nandCache[i];
+	m_writeEnabled = false;
+	setBusy(m_config.pageProgramTime);
+    }
+    else if (m_writeEnabled && op == 0xD8 && m_spiCmd.size() == 4)
+    {
+	size_t block = (size_t)page * pageSize / m_config.nandBlockSize * m_config.nandBlockSize;
+	std::fill(&m_flash[block], &m_flash[block] + m_config.nandBlockSize, 0xFF);
+	m_writeEnabled = false;
+	setBusy(m_config.blockEraseTime64kTyp * 1000.0);
+    }
+}
+
+void JobPlanner::spiDeselect()
+{
+    if (m_spiCmd.empty())
+	return;
+
+    if (m_config.nandPageSize != 0)
+    {
+	nandDeselect();
+	return;
+    }
+
+    uint8_t op = m_spiCmd[0];
+    uint32_t addr = 0;
+    if (m_spiCmd.size() >= 4)
+    {
+	addr = ((m_spiCmd[1] << 16) | (m_spiCmd[2] << 8) | m_spiCmd[3]) % m_flash.size();
+    }
+
+    if (op == 0xAB)
+    {
+	m_poweredDown = false;
+    }
+    else if (op == 0xB9)
+    {
+	m_poweredDown = true;
+    }
+    else if (op == 0x75 && m_now < m_busyUntil && m_busyErase)
+    {
+	// Suspend takes tSUS, the rest of the erase waits for the resume
+	m_suspendedUs = m_busyUntil - m_now;
+	m_busyUntil = m_now + 20;
+    }
+    else if (op == 0x7A && m_suspendedUs > 0)
+    {
+	m_busyUntil = m_now + m_suspendedUs;
+	m_suspendedUs = 0;
+    }
+    else if (m_now < m_busyUntil)
+    {
+	// Commands other than status reads are ignored while busy
+    }
+    else if (op == 0x06)
+    {
+	m_writeEnabled = true;
+    }
+    else if (op == 0x04)
+    {
+	m_writeEnabled = false;
+    }
+    else if (m_writeEnabled && (op == 0xC7 || op == 0x60))
+    {
+	std::fill(m_flash.begin(), m_flash.end(), 0xFF);
+	m_writeEnabled = false;
+	setBusy(m_config.chipEraseTimeTyp * 1000.0);
+	m_busyErase = false;
+    }
+    else if (m_writeEnabled && op == 0xD8 && m_spiCmd.size() == 4)
+    {
+	std::fill(&m_flash[addr & ~0xffff], &m_flash[addr & ~0xffff] + 0x10000, 0xFF);
+	m_writeEnabled = false;
+	setBusy(m_config.blockEraseTime64kTyp * 1000.0);
+	m_busyErase = true;
+    }
+    else if (m_writeEnabled && op == 0x20 && m_spiCmd.size() == 4)
+    {
+	std::fill(&m_flash[addr & ~0xfff], &m_flash[addr & ~0xfff] + 0x1000, 0xFF);
+	m_writeEnabled = false;
+	setBusy(subsector_erase_us);
+	m_busyErase = true;
+    }
+    else if (m_writeEnabled && op == 0x02 && m_spiCmd.size() > 4)
+    {
+	for (size_t i = 4; i < m_spiCmd.size(); i++)
+	{
+	    // Addresses wrap around within the page
+	    uint32_t byteAddr = (addr & ~0xff) | ((addr + i - 4) & 0xff);
+	    m_flash[byteAddr] &= m_spiCmd[i];
+	}
+	m_writeEnabled = false;
+	setBusy(m_config.pageProgramTime);
+	m_busyErase = false;
+    }
+}
+
+void JobPlanner::execute(const uint8_t *data, size_t size)
+{
+    size_t i = 0;
+    auto length = [&]() -> size_t {
+	if (i + 2 >= size)
+	    throw std::runtime_error("Plan: truncated MPSSE command.");
+	return (data[i + 1] | (data[i + 2] << 8)) + 1;
+    };
+
+    while (i < size)
+    {
+	uint8_t cmd = data[i];
+	switch (cmd)
+	{
+	case SET_BITS_LOW:
+	{
+	    bool selected = (data[i + 1] & m_cs_bits) == 0;
+	    if (m_selected && !selected)
+		spiDeselect();
+	    if (!m_selected && selected)
+		m_spiCmd.clear();
+	    m_selected = selected;
+
+	    // Releasing CRESET_B starts a new iCE40 configuration
+	    if ((data[i + 2] & ICE_CRESET) && !(data[i + 1] & ICE_CRESET))
+		m_cdone = false;
+	    m_pins = data[i + 1];
+	    i += 3;
+	    break;
+	}
+	case TCK_DIVISOR:
+	    m_byteUs = 8.0 / (m_baseClockMHz / (((data[i + 1] | (data[i + 2] << 8)) + 1) * 2));
+	    i += 3;
+	    break;
+	case DIS_DIV_5:
+	    m_baseClockMHz = 60.0;
+	    i += 1;
+	    break;
+	case EN_DIV_5:
+	    m_baseClockMHz = 12.0;
+	    i += 1;
+	    break;
+	case SET_BITS_HIGH:
+	    i += 3;
+	    break;
+	case GET_BITS_LOW:
+	    m_rx.push_back(m_pins | (m_cdone ? ICE_CDONE : 0));
+	    i += 1;
+	    break;
+	case GET_BITS_HIGH:
+	    m_rx.push_back(0xFF);
+	    i += 1;
+	    break;
+	case 0x11: // Data out
+	{
+	    size_t n = length();
+	    for (size_t k = 0; k < n; k++)
+		spiByte(data[i + 3 + k]);
+	    i += 3 + n;
+	    break;
+	}
+	case 0x13: // Data bits out, the final clocks of an iCE40 configuration
+	    advance((data[i + 1] + 1) * m_byteUs / 8);
+	    if (m_pins & ICE_CRESET)
+		m_cdone = true;
+	    i += 3;
+	    break;
+	case 0x20: // Data in
+	{
+	    size_t n = length();
+	    for (size_t k = 0; k < n; k++)
+		m_rx.push_back(spiByte(0xFF));
+	    i += 3;
+	    break;
+	}
+	case 0x31: // Data out and in
+	{
+	    size_t n = length();
+	    for (size_t k = 0; k < n; k++)
+		m_rx.push_back(spiByte(data[i + 3 + k]));
+	    i += 3 + n;
+	    break;
+	}
+	case 0x8F: // Clock bytes without data
+	{
+	    size_t n = length();
+	    advance(n * m_byteUs);
+	    i += 3;
+	    break;
+	}
+	case 0x8E: // Clock bits without data
+	    advance((data[i + 1] + 1) * m_byteUs / 8);
+	    i += 2;
+	    break;
+	case SEND_IMMEDIATE:
+	case LOOPBACK_START:
+	case LOOPBACK_END:
+	case 0x8C: // Enable 3 phase clocking
+	case 0x8D: // Disable 3 phase clocking
+	case 0x97: // Disable adaptive clocking
+	    i += 1;
+	    break;
+	default:
+	    throw std::runtime_error(Formatter() << "Plan: unsupported MPSSE command 0x" << std::hex << (int)cmd << ".");
+	}
+    }
+}
+
+double JobPlanner::totalSeconds() const
+{
+    double us = 0;
+    for (auto &p : m_phases)
+    {
+	us += p.us;
+    }
+    return us / 1000000;
+}
+
+void JobPlanner::report(std::ostream &out) const
+{
+    std::vector<Phase> phases(m_phases);
+    Phase total;
+    total.name = "Total";
+    for (auto &p : phases)
+    {
+	total.us += p.us;
+	total.writes += p.writes;
+	total.bytesOut += p.bytesOut;
+	total.reads += p.reads;
+	total.bytesIn += p.bytesIn;
+	total.polls += p.polls;
+	total.sleepUs += p.sleepUs;
+	total.busyUs += p.busyUs;
+    }
+    phases.push_back(total);
+
+    std::ios::fmtflags flags = out.flags();
+    char fill = out.fill(' ');
+
+    out << "Plan for " << m_config.manfacturerName << " " << m_config.memoryName <<
+	", SPI clock " << 8.0 / m_byteUs << " MHz" << std::endl << std::endl;
+
+    out << std::left << std::setw(12) << "Phase" << std::right <<
+	std::setw(10) << "Time [s]" <<
+	std::setw(8) << "Writes" <<
+	std::setw(12) << "Out [kB]" <<
+	std::setw(8) << "Reads" <<
+	std::setw(12) << "In [kB]" <<
+	std::setw(8) << "Polls" <<
+	std::setw(11) << "Sleep [s]" <<
+	std::setw(10) << "Chip [s]" << std::endl;
+
+    out << std::fixed;
+    for (auto &p : phases)
+    {
+	out << std::left << std::setw(12) << p.name << std::right <<
+	    std::setprecision(3) << std::setw(10) << p.us / 1000000 <<
+	    std::setw(8) << p.writes <<
+	    std::setprecision(1) << std::setw(12) << p.bytesOut / 1024.0 <<
+	    std::setw(8) << p.reads <<
+	    std::setw(12) << p.bytesIn / 1024.0 <<
+	    std::setw(8) << p.polls <<
+	    std::setprecision(3) << std::setw(11) << p.sleepUs / 1000000 <<
+	    std::setw(10) << p.busyUs / 1000000 << std::endl;
+    }
+    out.flags(flags);
+    out.fill(fill);
+}
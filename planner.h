@@ -0,0 +1,102 @@
+#ifndef PLANNER_H
+#define PLANNER_H
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "ftdispi.h"
+
+/*
+ * Dry-run sink that predicts how long a job takes. The planner executes the
+ * MPSSE command stream against a simulated SPI NOR flash (so status polls,
+ * reads and verification behave as on a real chip) and keeps a simulated
+ * clock built from SCK (taken from the clock commands in the stream), the
+ * chip's typical erase/program times, USB transfer overheads and the host's
+ * polling sleeps. Time is accounted per job phase. Memories with a NAND
+ * geometry are simulated as SPI NAND without bad blocks.
+ */
+class JobPlanner : public ftdisink {
+
+public:
+    JobPlanner(const FlashConfig &config, uint8_t cs_bits = 0x08);
+
+    void write(const uint8_t *data, size_t size, const std::string &operation_name) override;
+    void read(uint8_t *data, size_t size, const std::string &operation_name) override;
+    void sleep(uint32_t us) override;
+    void phase(const std::string &name) override;
+
+    // Loads data into the simulated flash, e.g. to plan a verify-only job
+    void preload(uint32_t addr, const uint8_t *data, size_t size);
+
+    double totalSeconds() const;
+    void report(std::ostream &out) const;
+
+private:
+    /* Host side cost model for a high-speed FT2232H/FT4232H: every write is
+     * split into transfers of the 8 kB write chunk size, each costing about
+     * one microframe plus the payload at the practical bulk throughput. A
+     * read completes one round trip after its SEND_IMMEDIATE. */
+    static constexpr double usb_transfer_us = 125.0;
+    static constexpr double usb_bytes_per_us = 35.0;
+    static constexpr double usb_read_round_trip_us = 250.0;
+    static constexpr size_t usb_chunk_size = 8 * 1024;
+
+    // Typical 4 kB subsector erase time, not part of the memory table
+    static constexpr double subsector_erase_us = 45000.0;
+
+    struct Phase
+    {
+	std::string name;
+	double us = 0;
+	uint32_t writes = 0;
+	uint64_t bytesOut = 0;
+	uint32_t reads = 0;
+	uint64_t bytesIn = 0;
+	uint32_t polls = 0;
+	double sleepUs = 0;
+	double busyUs = 0;
+    };
+
+    FlashConfig m_config;
+    uint8_t m_cs_bits;
+
+    // SCK as set up by the clock commands in the stream
+    double m_baseClockMHz = 12.0;
+    double m_byteUs = 8.0 / 6.0;
+
+    std::vector<Phase> m_phases;
+    size_t m_current = 0;
+    double m_now = 0;
+
+    // Simulated flash
+    std::vector<uint8_t> m_flash;
+    std::vector<uint8_t> m_spiCmd;
+    std::vector<uint8_t> m_rx;
+    bool m_selected = false;
+    bool m_writeEnabled = false;
+    bool m_poweredDown = false;
+    double m_busyUntil = 0;
+    double m_suspendedUs = 0;           // busy time left of a suspended erase
+    bool m_busyErase = false;           // busy with a sector erase, which can be suspended
+    uint8_t m_pins = 0;
+    bool m_cdone = true;
+
+    // Simulated SPI NAND page cache and feature registers
+    std::vector<uint8_t> m_nandCache;
+    uint32_t m_nandPage = 0;
+    uint8_t m_nandProtection = 0x7C;
+    uint8_t m_nandConfig = 0x18;
+
+    Phase &current();
+    void advance(double us);
+    uint8_t spiByte(uint8_t out);
+    void spiDeselect();
+    uint8_t nandByte(size_t pos);
+    void nandDeselect();
+    void setBusy(double us);
+    void execute(const uint8_t *data, size_t size);
+};
+
+#endif // PLANNER_H
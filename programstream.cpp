@@ -0,0 +1,271 @@
+#include "programstream.h"
+#include "flashprogrammer.h"
+#include "utils.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char streamMagic[8] = { 'F', 'T', 'D', 'I', 'S', 'T', 'R', 'M' };
+static const uint32_t streamVersion = 1;
+
+static const size_t shaHexSize = 64;
+static const size_t bulkEntrySize = 12;
+
+static void put32(std::vector<uint8_t> &out, uint32_t value)
+{
+    uint8_t bytes[4] = { (uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16), (uint8_t)(value >> 24) };
+    out.insert(out.end(), bytes, bytes + sizeof(bytes));
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void putDigest(std::vector<uint8_t> &out, const FlashDigest::Entry &entry)
+{
+    put32(out, entry.crc);
+    out.insert(out.end(), entry.sha256.begin(), entry.sha256.end());
+}
+
+/* Reads the stream in place, checking every access against the mapped size. */
+class StreamReader
+{
+public:
+    StreamReader(const uint8_t *data, size_t size, const std::string &path) :
+	m_data(data), m_size(size), m_path(path)
+    {
+    }
+
+    const uint8_t *take(size_t n)
+    {
+	if (n > m_size - m_offset)
+	{
+	    throw std::runtime_error(Formatter() << "Stream file " << m_path << " is truncated.");
+	}
+	const uint8_t *p = m_data + m_offset;
+	m_offset += n;
+	return p;
+    }
+
+    uint32_t get32()
+    {
+	return ::get32(take(4));
+    }
+
+    FlashDigest::Entry getDigest()
+    {
+	FlashDigest::Entry entry;
+	entry.crc = get32();
+	entry.sha256.assign((const char *)take(shaHexSize), shaHexSize);
+	return entry;
+    }
+
+    size_t offset() const       { return m_offset; }
+
+private:
+    const uint8_t *m_data;
+    size_t m_size;
+    const std::string &m_path;
+    size_t m_offset = 0;
+};
+
+bool ProgramStream::isStream(const std::string &path)
+{
+    std::ifstream in(path.c_str(), std::ifstream::binary);
+    char magic[sizeof(streamMagic)];
+
+    return in.read(magic, sizeof(magic)) && memcmp(magic, streamMagic, sizeof(magic)) == 0;
+}
+
+/* Builds the page program bulks with a status read appended to each, and
+ * digests the image as it will read back, gaps included. */
+void ProgramStream::compile(FlashProgrammer &programmer, uint32_t addr, const FlashImage &image, EraseMode erase,
+    const std::string &path)
+{
+    FlashProgrammer::ProgramBulks program = programmer.buildProgram(addr, image);
+
+    ftditransaction poll(programmer.spi());
+    programmer.spi().flash_read_status(poll);
+    std::vector<uint8_t> pollCommands = poll.commands();
+    pollCommands.push_back(SEND_IMMEDIATE);
+
+    std::vector<uint8_t> flat = image.flatten();
+    FlashDigest digest(addr);
+    digest.update(flat.data(), flat.size());
+    digest.final();
+
+    uint32_t dataCrc = 0;
+    for (auto &bulk : program.bulks)
+    {
+	bulk.insert(bulk.end(), pollCommands.begin(), pollCommands.end());
+	dataCrc = crc32(bulk.data(), bulk.size(), dataCrc);
+    }
+
+    std::vector<uint8_t> header(streamMagic, streamMagic + sizeof(streamMagic));
+    put32(header, streamVersion);
+    put32(header, (program.jedecId[0] << 16) | (program.jedecId[1] << 8) | program.jedecId[2]);
+    put32(header, program.divisor);
+    put32(header, programmer.spi().getCsBits());
+    put32(header, programmer.spi().getPinDir());
+    put32(header, addr);
+    put32(header, image.size());
+    put32(header, erase);
+    put32(header, 0x10000);
+    put32(header, digest.sectors().size());
+    put32(header, program.bulks.size());
+    put32(header, dataCrc);
+
+    std::vector<uint8_t> tables;
+    putDigest(tables, digest.range());
+    for (auto &sector : digest.sectors())
+    {
+	put32(tables, sector.addr);
+	put32(tables, sector.length);
+	putDigest(tables, sector);
+    }
+
+    uint32_t offset = header.size() + 4 + tables.size() + program.bulks.size() * bulkEntrySize;
+    for (size_t i = 0; i < program.bulks.size(); i++)
+    {
+	put32(tables, offset);
+	put32(tables, program.bulks[i].size());
+	put32(tables, program.done[i]);
+	offset += program.bulks[i].size();
+    }
+    put32(header, crc32(tables.data(), tables.size(), crc32(header.data(), header.size())));
+
+    std::ofstream out(path.c_str(), std::ofstream::binary | std::ofstream::trunc);
+    out.write((const char *)header.data(), header.size());
+    out.write((const char *)tables.data(), tables.size());
+    for (auto &bulk : program.bulks)
+    {
+	out.write((const char *)bulk.data(), bulk.size());
+    }
+    if (!out.flush())
+    {
+	throw std::runtime_error(Formatter() << "Could not write stream file " << path << ".");
+    }
+}
+
+ProgramStream::ProgramStream(const std::string &path) :
+    m_path(path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+	if (fd >= 0)
+	    close(fd);
+	throw std::runtime_error(Formatter() << "Could not open stream file " << path << ": " << strerror(errno));
+    }
+
+    m_mapSize = st.st_size;
+    void *map = m_mapSize > 0 ? mmap(nullptr, m_mapSize, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+	throw std::runtime_error(Formatter() << "Could not map stream file " << path << ".");
+    }
+    m_map = (const uint8_t *)map;
+
+    try
+    {
+	StreamReader in(m_map, m_mapSize, path);
+	if (memcmp(in.take(sizeof(streamMagic)), streamMagic, sizeof(streamMagic)) != 0)
+	{
+	    throw std::runtime_error(Formatter() << "File " << path << " is not a stream file.");
+	}
+	uint32_t version = in.get32();
+	if (version != streamVersion)
+	{
+	    throw std::runtime_error(Formatter() << "Stream file " << path << " has unsupported version " << version << ".");
+	}
+
+	uint32_t jedecId = in.get32();
+	m_jedecId[0] = jedecId >> 16;
+	m_jedecId[1] = jedecId >> 8;
+	m_jedecId[2] = jedecId;
+	m_divisor = in.get32();
+	m_csBits = in.get32();
+	m_pinDir = in.get32();
+	m_base = in.get32();
+	m_size = in.get32();
+	m_erase = (EraseMode)in.get32();
+	m_sectorSize = in.get32();
+	uint32_t sectors = in.get32();
+	m_bulks = in.get32();
+	uint32_t dataCrc = in.get32();
+	uint32_t headerSize = in.offset();
+	uint32_t tableCrc = in.get32();
+
+	m_range = in.getDigest();
+	m_range.addr = m_base;
+	m_range.length = m_size;
+	for (uint32_t i = 0; i < sectors; i++)
+	{
+	    FlashDigest::Entry sector;
+	    sector.addr = in.get32();
+	    sector.length = in.get32();
+	    FlashDigest::Entry digest = in.getDigest();
+	    sector.crc = digest.crc;
+	    sector.sha256 = digest.sha256;
+	    m_sectors.push_back(sector);
+	}
+	m_bulkTable = in.take(m_bulks * bulkEntrySize);
+
+	uint32_t crc = crc32(m_map, headerSize);
+	crc = crc32(m_map + headerSize + 4, in.offset() - headerSize - 4, crc);
+	if (crc != tableCrc)
+	{
+	    throw std::runtime_error(Formatter() << "Stream file " << path << " is corrupted.");
+	}
+
+	// Bulks go to the device unchecked, so their data is checked here
+	crc = 0;
+	for (size_t i = 0; i < m_bulks; i++)
+	{
+	    uint32_t offset = get32(m_bulkTable + i * bulkEntrySize);
+	    if (offset > m_mapSize || bulkSize(i) > m_mapSize - offset)
+	    {
+		throw std::runtime_error(Formatter() << "Stream file " << path << " is truncated.");
+	    }
+	    crc = crc32(bulk(i), bulkSize(i), crc);
+	}
+	if (crc != dataCrc)
+	{
+	    throw std::runtime_error(Formatter() << "Stream file " << path << " is corrupted.");
+	}
+    }
+    catch (...)
+    {
+	munmap((void *)m_map, m_mapSize);
+	throw;
+    }
+}
+
+ProgramStream::~ProgramStream()
+{
+    munmap((void *)m_map, m_mapSize);
+}
+
+const uint8_t *ProgramStream::bulk(size_t index) const
+{
+    return m_map + get32(m_bulkTable + index * bulkEntrySize);
+}
+
+uint32_t ProgramStream::bulkSize(size_t index) const
+{
+    return get32(m_bulkTable + index * bulkEntrySize + 4);
+}
+
+uint32_t ProgramStream::bulkDone(size_t index) const
+{
+    return get32(m_bulkTable + index * bulkEntrySize + 8);
+}
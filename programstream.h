@@ -0,0 +1,87 @@
+#ifndef PROGRAM_STREAM_H
+#define PROGRAM_STREAM_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "digest.h"
+#include "flashimage.h"
+
+class FlashProgrammer;
+
+/*
+ * Precompiled programming stream: the exact MPSSE bulks that program an image
+ * into one memory at one SPI clock, together with the erase plan and the
+ * digests to verify against. The file is memory mapped and its bulks are sent
+ * to the device as they are, so repeated flashing of the same image costs no
+ * host work beyond the USB transfers. Every bulk ends with a status read.
+ *
+ * Stream format, all numbers 32-bit little endian:
+ *   "FTDISTRM", version, JEDEC ID, divisor, CS bits, pin direction,
+ *   base address, image size, erase mode, digest sector size, sector count,
+ *   bulk count, CRC-32 of the bulk data, CRC-32 of everything before it
+ *   range digest: CRC-32 and SHA-256 as 64 hex characters
+ *   per sector: address, length, CRC-32 and SHA-256
+ *   per bulk: file offset, length and image bytes programmed after it
+ *   the bulk data
+ */
+class ProgramStream
+{
+public:
+    enum EraseMode
+    {
+	ERASE_NONE,
+	ERASE_CHIP,
+	ERASE_SECTORS       // the 64 kB sectors covering the image
+    };
+
+    static bool isStream(const std::string &path);
+
+    // Builds the stream for the memory and SPI clock of the programmer
+    static void compile(FlashProgrammer &programmer, uint32_t addr, const FlashImage &image, EraseMode erase,
+	const std::string &path);
+
+    explicit ProgramStream(const std::string &path);
+    ~ProgramStream();
+
+    const uint8_t *jedecId() const      { return m_jedecId; }
+    uint32_t divisor() const            { return m_divisor; }
+    uint8_t csBits() const              { return m_csBits; }
+    uint8_t pinDir() const              { return m_pinDir; }
+    uint32_t base() const               { return m_base; }
+    uint32_t size() const               { return m_size; }
+    EraseMode erase() const             { return m_erase; }
+
+    uint32_t sectorSize() const                         { return m_sectorSize; }
+    const FlashDigest::Entry &range() const             { return m_range; }
+    const std::vector<FlashDigest::Entry> &sectors() const { return m_sectors; }
+
+    size_t bulks() const                { return m_bulks; }
+    const uint8_t *bulk(size_t index) const;
+    uint32_t bulkSize(size_t index) const;
+    uint32_t bulkDone(size_t index) const;
+
+private:
+    std::string m_path;
+    const uint8_t *m_map = nullptr;
+    size_t m_mapSize = 0;
+
+    uint8_t m_jedecId[3];
+    uint32_t m_divisor;
+    uint8_t m_csBits;
+    uint8_t m_pinDir;
+    uint32_t m_base;
+    uint32_t m_size;
+    EraseMode m_erase;
+    uint32_t m_sectorSize;
+    FlashDigest::Entry m_range;
+    std::vector<FlashDigest::Entry> m_sectors;
+    size_t m_bulks;
+    const uint8_t *m_bulkTable;
+
+    ProgramStream(const ProgramStream &);
+    ProgramStream & operator = (ProgramStream &);
+};
+
+#endif // PROGRAM_STREAM_H
@@ -0,0 +1,171 @@
+#include "registry.h"
+#include "utils.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <unistd.h>
+
+static const char *registryMagic = "ftdiflash-registry 1";
+
+BoardRegistry::BoardRegistry(const std::string &path) :
+    m_path(path),
+    m_file(nullptr),
+    m_lines(0)
+{
+}
+
+BoardRegistry::~BoardRegistry()
+{
+    if (m_file != nullptr)
+    {
+	fclose(m_file);
+    }
+}
+
+/* Later records replace earlier ones for the same sector. The file is rewritten
+ * without the replaced records once they make up most of it. */
+void BoardRegistry::open()
+{
+    std::ifstream in(m_path.c_str());
+    bool exists = in.is_open();
+    if (exists)
+    {
+	std::string line;
+	if (!std::getline(in, line) || line != registryMagic)
+	{
+	    throw std::runtime_error(Formatter() << m_path << " is not a board registry.");
+	}
+
+	while (std::getline(in, line))
+	{
+	    char record = 0;
+	    char board[64];
+	    unsigned int addr = 0;
+	    char sha256[65];
+
+	    // A torn last line from an interrupted run is simply ignored
+	    int fields = sscanf(line.c_str(), "%c %63s %x %64s", &record, board, &addr, sha256);
+	    if (record == 'S' && fields == 4)
+	    {
+		m_boards[board][addr] = sha256;
+	    }
+	    else if (record == 'X' && fields >= 3)
+	    {
+		m_boards[board].erase(addr);
+	    }
+	    m_lines++;
+	}
+	in.close();
+    }
+
+    size_t live = 0;
+    for (auto &board : m_boards)
+	live += board.second.size();
+
+    if (!exists || m_lines > 2 * live + 64)
+    {
+	compact();
+    }
+
+    m_file = fopen(m_path.c_str(), "a");
+    if (m_file == nullptr)
+    {
+	throw std::runtime_error(Formatter() << "Could not open board registry " << m_path << ".");
+    }
+}
+
+/* Writes the live records to a new file that replaces the registry at once. */
+void BoardRegistry::compact()
+{
+    std::string tempPath = m_path + ".tmp";
+    FILE *file = fopen(tempPath.c_str(), "w");
+    if (file == nullptr)
+    {
+	throw std::runtime_error(Formatter() << "Could not write board registry " << tempPath << ".");
+    }
+
+    fprintf(file, "%s\n", registryMagic);
+    m_lines = 0;
+    for (auto &board : m_boards)
+    {
+	for (auto &sector : board.second)
+	{
+	    fprintf(file, "S %s %06x %s\n", board.first.c_str(), sector.first, sector.second.c_str());
+	    m_lines++;
+	}
+    }
+    bool written = !ferror(file) && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    int error = errno;
+    if (fclose(file) != 0 && written)
+    {
+	written = false;
+	error = errno;
+    }
+    if (!written)
+    {
+	unlink(tempPath.c_str());
+	throw std::runtime_error(Formatter() << "Could not write board registry " << tempPath << ": " << strerror(error));
+    }
+
+    if (rename(tempPath.c_str(), m_path.c_str()) != 0)
+    {
+	throw std::runtime_error(Formatter() << "Could not replace board registry " << m_path << ".");
+    }
+}
+
+bool BoardRegistry::sector(const std::string &board, uint32_t addr, std::string &sha256) const
+{
+    auto it = m_boards.find(board);
+    if (it == m_boards.end())
+	return false;
+
+    auto sector = it->second.find(addr);
+    if (sector == it->second.end())
+	return false;
+
+    sha256 = sector->second;
+    return true;
+}
+
+size_t BoardRegistry::sectors(const std::string &board) const
+{
+    auto it = m_boards.find(board);
+    return it == m_boards.end() ? 0 : it->second.size();
+}
+
+void BoardRegistry::record(const std::string &board, uint32_t addr, const std::string &sha256)
+{
+    m_boards[board][addr] = sha256;
+    append('S', board, addr, sha256);
+}
+
+void BoardRegistry::forget(const std::string &board, uint32_t addr)
+{
+    if (m_boards[board].erase(addr) != 0)
+	append('X', board, addr, "");
+}
+
+void BoardRegistry::forget(const std::string &board)
+{
+    std::map<uint32_t, std::string> sectors;
+    sectors.swap(m_boards[board]);
+    for (auto &sector : sectors)
+	append('X', board, sector.first, "");
+}
+
+void BoardRegistry::append(char record, const std::string &board, uint32_t addr, const std::string &sha256)
+{
+    if (m_file == nullptr)
+	return;
+
+    // A record that is not on disk must not be acted upon, e.g. by erasing a
+    // sector the registry still lists
+    if (fprintf(m_file, "%c %s %06x%s%s\n", record, board.c_str(), addr, sha256.empty() ? "" : " ", sha256.c_str()) < 0 ||
+	fflush(m_file) != 0 || fsync(fileno(m_file)) != 0)
+    {
+	throw std::runtime_error(Formatter() << "Could not write board registry " << m_path << ": " << strerror(errno));
+    }
+    m_lines++;
+}
@@ -0,0 +1,47 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <string>
+
+/*
+ * Local record of what was last programmed and verified on each board, keyed
+ * by the flash unique ID: the SHA-256 of every 64 kB sector written. Records
+ * are appended and synced as sectors complete; a sector about to be rewritten
+ * is first recorded as unknown, so an interrupted update is never trusted.
+ */
+class BoardRegistry
+{
+public:
+    explicit BoardRegistry(const std::string &path);
+    ~BoardRegistry();
+
+    // Loads the records and opens the file for appending
+    void open();
+
+    bool sector(const std::string &board, uint32_t addr, std::string &sha256) const;
+    size_t sectors(const std::string &board) const;
+
+    void record(const std::string &board, uint32_t addr, const std::string &sha256);
+    void forget(const std::string &board, uint32_t addr);
+    void forget(const std::string &board);
+
+    const std::string &path() const { return m_path; }
+
+private:
+    std::string m_path;
+    FILE *m_file;
+    uint32_t m_lines;
+
+    std::map<std::string, std::map<uint32_t, std::string>> m_boards;
+
+    void compact();
+    void append(char record, const std::string &board, uint32_t addr, const std::string &sha256);
+
+    BoardRegistry(const BoardRegistry &);
+    BoardRegistry & operator = (BoardRegistry &);
+};
+
+#endif // REGISTRY_H
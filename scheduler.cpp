@@ -0,0 +1,93 @@
+#include "scheduler.h"
+#include "utils.h"
+
+#include <algorithm>
+
+UsbScheduler::Lease::Lease(UsbScheduler *scheduler, const std::vector<std::string> &links) :
+    m_scheduler(scheduler),
+    m_links(links)
+{
+}
+
+UsbScheduler::Lease::Lease(Lease &&other) :
+    m_scheduler(other.m_scheduler),
+    m_links(std::move(other.m_links))
+{
+    other.m_scheduler = nullptr;
+}
+
+UsbScheduler::Lease::~Lease()
+{
+    if (m_scheduler != nullptr)
+	m_scheduler->release(m_links);
+}
+
+UsbScheduler::UsbScheduler(unsigned linkSlots) :
+    m_linkSlots(std::max(linkSlots, 1u))
+{
+}
+
+/* Only the links upstream of hubs are shared: the root port, then the port
+ * of every hub below it. The device's own port carries its traffic only. */
+std::vector<std::string> UsbScheduler::links(uint8_t bus, const uint8_t *ports, int depth)
+{
+    std::vector<std::string> result;
+    std::string path = Formatter() << (int)bus << "-";
+    int shared = std::max(depth - 1, 1);
+    for (int i = 0; i < shared && i < depth; i++)
+    {
+	path += Formatter() << (i > 0 ? "." : "") << (int)ports[i];
+	result.push_back(path);
+    }
+    return result;
+}
+
+bool UsbScheduler::admissible(const Request &request)
+{
+    for (auto other : m_waiting)
+    {
+	if (other == &request)
+	    break;
+	for (auto &link : *other)
+	{
+	    if (std::find(request.begin(), request.end(), link) != request.end())
+		return false;
+	}
+    }
+
+    for (auto &link : request)
+    {
+	auto used = m_used.find(link);
+	if (used != m_used.end() && used->second >= m_linkSlots)
+	    return false;
+    }
+    return true;
+}
+
+UsbScheduler::Lease UsbScheduler::acquire(const std::vector<std::string> &links)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    m_waiting.push_back(&links);
+    m_cond.wait(lock, [this, &links]() { return admissible(links); });
+    m_waiting.remove(&links);
+
+    for (auto &link : links)
+	m_used[link]++;
+
+    // Requests behind this one may not share its links
+    m_cond.notify_all();
+    return Lease(this, links);
+}
+
+void UsbScheduler::release(const std::vector<std::string> &links)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    for (auto &link : links)
+    {
+	if (--m_used[link] == 0)
+	    m_used.erase(link);
+    }
+    m_cond.notify_all();
+}
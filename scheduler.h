@@ -0,0 +1,69 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+ * Shares USB links among programmers behind common hubs. A device is known
+ * by the links between it and the host: its root port and every hub on the
+ * way. Bandwidth-heavy phases (page programming, verify reads) take a slot
+ * on every link of the path and wait while one of them is full; an FT2232H
+ * in such a phase keeps 64 kB bulks in flight back to back, so the number
+ * of boards bursting at once is what loads a hub, not their SCK rate.
+ * Latency-bound phases such as erase polling take no slot, so boards erasing
+ * leave the link to those programming. Waiters sharing a link are served in
+ * order.
+ */
+class UsbScheduler
+{
+public:
+    // A slot on each link, given back when destroyed
+    class Lease
+    {
+    public:
+	Lease(Lease &&other);
+	~Lease();
+
+    private:
+	friend class UsbScheduler;
+
+	UsbScheduler *m_scheduler;
+	std::vector<std::string> m_links;
+
+	Lease(UsbScheduler *scheduler, const std::vector<std::string> &links);
+	Lease(const Lease &);
+	Lease & operator = (const Lease &);
+    };
+
+    // Boards each root port or hub link carries in a heavy phase at once
+    explicit UsbScheduler(unsigned linkSlots);
+
+    // Links of a device from its bus and port numbers, e.g. "1-2" and "1-2.4"
+    static std::vector<std::string> links(uint8_t bus, const uint8_t *ports, int depth);
+
+    // Blocks until every link has a free slot
+    Lease acquire(const std::vector<std::string> &links);
+
+private:
+    typedef std::vector<std::string> Request;
+
+    unsigned m_linkSlots;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::map<std::string, unsigned> m_used;
+    std::list<const Request *> m_waiting;
+
+    bool admissible(const Request &request);
+    void release(const std::vector<std::string> &links);
+
+    UsbScheduler(const UsbScheduler &);
+    UsbScheduler & operator = (UsbScheduler &);
+};
+
+#endif // SCHEDULER_H
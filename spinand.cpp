@@ -0,0 +1,431 @@
+#include "spinand.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+// SPI NAND command set
+static const uint8_t opReadId = 0x9F;
+static const uint8_t opReset = 0xFF;
+static const uint8_t opGetFeature = 0x0F;
+static const uint8_t opSetFeature = 0x1F;
+static const uint8_t opWriteEnable = 0x06;
+static const uint8_t opPageRead = 0x13;
+static const uint8_t opReadCache = 0x03;
+static const uint8_t opProgramLoad = 0x02;
+static const uint8_t opProgramExecute = 0x10;
+static const uint8_t opBlockErase = 0xD8;
+
+// Feature registers and their bits
+static const uint8_t regProtection = 0xA0;
+static const uint8_t regConfig = 0xB0;
+static const uint8_t regStatus = 0xC0;
+
+static const uint8_t configEcc = 0x10;
+static const uint8_t configBuffer = 0x08;
+
+static const uint8_t statusBusy = 0x01;
+static const uint8_t statusEraseFail = 0x04;
+static const uint8_t statusProgramFail = 0x08;
+static const uint8_t statusEccUncorrectable = 0x20;
+
+// Page read time with ECC enabled and reset time, in us
+static const uint32_t pageReadTime = 60;
+static const uint32_t resetTime = 500;
+
+// MPSSE command bytes per program bulk and read bytes per USB round trip
+static const uint32_t bulkSize = 64 * 1024;
+static const uint32_t readChunkSize = 64 * 1024;
+
+const std::vector<FlashConfig> &SpiNand::memories()
+{
+    // Erase times are per 128 kB block
+    static const std::vector<FlashConfig> memory =
+    {
+	{ "Winbond", 0xEF, 0xAA, 0x21, "W25N01GV", 128 * 1024 * 1024, 700, 10, 2, 2048, 2048, 128 * 1024 }
+    };
+
+    return memory;
+}
+
+const FlashConfig *SpiNand::findMemory(const uint8_t jedecId[3])
+{
+    for (auto &item : memories())
+    {
+	if (item.manufacturerId == jedecId[0] &&
+	    item.ID15_ID8 == jedecId[1] &&
+	    item.ID7_ID0 == jedecId[2])
+	{
+	    return &item;
+	}
+    }
+    return nullptr;
+}
+
+void SpiNand::readId(ftdispi &spi, uint8_t jedecId[3])
+{
+    ftditransaction t(spi, "NAND Read Id");
+    t.chip_select();
+    t.data_out({ opReadId, 0x00 });
+    ftdiresult_ptr id = t.data_in(3);
+    t.chip_deselect();
+    t.flush();
+
+    std::memcpy(jedecId, id->data().data(), 3);
+}
+
+SpiNand::SpiNand(ftdispi &spi, const FlashConfig &config) :
+    m_spi(spi),
+    m_config(config),
+    m_pagesPerBlock(config.nandBlockSize / config.nandPageSize)
+{
+}
+
+void SpiNand::writeCommand(ftditransaction &t, std::initializer_list<uint8_t> cmd)
+{
+    t.chip_select();
+    t.data_out(cmd);
+    t.chip_deselect();
+}
+
+ftdiresult_ptr SpiNand::getFeature(ftditransaction &t, uint8_t reg)
+{
+    t.chip_select();
+    t.data_out({ opGetFeature, reg });
+    ftdiresult_ptr value = t.data_in(1);
+    t.chip_deselect();
+    return value;
+}
+
+void SpiNand::setFeature(ftditransaction &t, uint8_t reg, uint8_t value)
+{
+    writeCommand(t, { opSetFeature, reg, value });
+}
+
+/* Polls the status register until the device is ready and returns the final
+ * status. The first poll goes out together with whatever is already queued. */
+uint8_t SpiNand::waitReady(ftditransaction &t, uint32_t timeoutMs)
+{
+    auto begin = std::chrono::steady_clock::now();
+
+    while (true)
+    {
+	ftdiresult_ptr status = getFeature(t, regStatus);
+	t.flush();
+
+	if (((*status)[0] & statusBusy) == 0)
+	    return (*status)[0];
+
+	if (std::chrono::steady_clock::now() - begin > std::chrono::milliseconds(timeoutMs))
+	{
+	    throw std::runtime_error("Waiting too long for flash memory to be ready.");
+	}
+	m_spi.sleep_us(250);
+    }
+}
+
+void SpiNand::waitReady()
+{
+    ftditransaction t(m_spi, "Wait");
+    waitReady(t, m_config.blockEraseTime64k);
+}
+
+void SpiNand::init()
+{
+    ftditransaction t(m_spi, "NAND init");
+    writeCommand(t, { opReset });
+    m_spi.flash_idle(t, resetTime);
+    waitReady(t, 10);
+
+    // Unprotect all blocks, enable ECC and use the buffer read mode by default
+    setFeature(t, regProtection, 0x00);
+    ftdiresult_ptr config = getFeature(t, regConfig);
+    t.flush();
+    setFeature(t, regConfig, (*config)[0] | configEcc | configBuffer);
+    t.flush();
+
+    scanBadBlocks();
+}
+
+/* Reads the factory bad block marker, the first spare byte of the first page,
+ * of every block. All reads are queued on one transaction. */
+void SpiNand::scanBadBlocks()
+{
+    uint32_t blocks = m_config.size / blockSize();
+    std::vector<ftdiresult_ptr> markers;
+
+    ftditransaction t(m_spi, "NAND bad block scan");
+    for (uint32_t block = 0; block < blocks; block++)
+    {
+	uint32_t page = block * m_pagesPerBlock;
+	writeCommand(t, { opPageRead, 0, (uint8_t)(page >> 8), (uint8_t)page });
+	m_spi.flash_idle(t, pageReadTime);
+
+	t.chip_select();
+	t.data_out({ opReadCache, (uint8_t)(pageSize() >> 8), (uint8_t)pageSize(), 0 });
+	markers.push_back(t.data_in(1));
+	t.chip_deselect();
+    }
+    t.flush();
+
+    m_goodBlocks.clear();
+    m_badBlocks.clear();
+    for (uint32_t block = 0; block < blocks; block++)
+    {
+	if ((*markers[block])[0] == 0xFF)
+	    m_goodBlocks.push_back(block);
+	else
+	    m_badBlocks.push_back(block);
+    }
+}
+
+/* Maps a logical address, counting good blocks only, to its physical page. */
+uint32_t SpiNand::physicalPage(uint32_t addr) const
+{
+    uint32_t block = addr / blockSize();
+    if (block >= m_goodBlocks.size())
+    {
+	throw std::runtime_error(Formatter() << "Address " << addr << " is beyond the " << usableSize() <<
+	    " bytes of good blocks.");
+    }
+    return m_goodBlocks[block] * m_pagesPerBlock + (addr % blockSize()) / pageSize();
+}
+
+void SpiNand::setBufferMode(bool buffer)
+{
+    ftditransaction t(m_spi, "NAND read mode");
+    ftdiresult_ptr config = getFeature(t, regConfig);
+    t.flush();
+
+    uint8_t value = buffer ? ((*config)[0] | configBuffer) : ((*config)[0] & ~configBuffer);
+    setFeature(t, regConfig, value);
+    t.flush();
+}
+
+void SpiNand::eraseBlock(uint32_t block)
+{
+    uint32_t page = block * m_pagesPerBlock;
+
+    ftditransaction erase(m_spi, "NAND block erase");
+    writeCommand(erase, { opWriteEnable });
+    writeCommand(erase, { opBlockErase, 0, (uint8_t)(page >> 8), (uint8_t)page });
+    m_spi.flash_idle(erase, m_config.blockEraseTime64kTyp * 1000);
+
+    uint8_t status = waitReady(erase, m_config.blockEraseTime64k);
+    if (status & statusEraseFail)
+    {
+	throw std::runtime_error(Formatter() << "Erase failed at block " << block << ".");
+    }
+}
+
+/* Erases all good blocks; factory bad blocks must keep their markers. */
+void SpiNand::eraseAll(StepCallback progress)
+{
+    for (uint32_t i = 0; i < m_goodBlocks.size(); i++)
+    {
+	eraseBlock(m_goodBlocks[i]);
+
+	if (progress)
+	    progress(i + 1);
+    }
+}
+
+/* Erases the blocks covering the logical range. */
+void SpiNand::erase(uint32_t addr, uint32_t length, StepCallback progress)
+{
+    uint32_t first = addr / blockSize();
+    uint32_t last = (addr + length + blockSize() - 1) / blockSize();
+
+    for (uint32_t block = first; block < last; block++)
+    {
+	if (block >= m_goodBlocks.size())
+	{
+	    throw std::runtime_error(Formatter() << "Address " << block * blockSize() << " is beyond the " <<
+		usableSize() << " bytes of good blocks.");
+	}
+	eraseBlock(m_goodBlocks[block]);
+
+	if (progress)
+	    progress((block + 1 - first) * blockSize());
+    }
+}
+
+/* Loads and programs the given physical pages. Write enable, program load,
+ * program execute and a status read are queued for every page and sent
+ * together; the idle clocks after each execute cover the maximum program time,
+ * so every deferred status should show its page done. Should a page still be
+ * busy, the device has ignored the commands behind it: it is waited for and
+ * the remaining pages are sent again. */
+void SpiNand::programPages(const std::vector<uint32_t> &pages, const std::vector<uint8_t> &data)
+{
+    ftditransaction bulk(m_spi, "NAND program");
+
+    size_t first = 0;
+    while (first < pages.size())
+    {
+	std::vector<ftdiresult_ptr> status;
+	for (size_t i = first; i < pages.size(); i++)
+	{
+	    uint32_t page = pages[i];
+
+	    writeCommand(bulk, { opWriteEnable });
+	    bulk.chip_select();
+	    bulk.data_out({ opProgramLoad, 0, 0 });
+	    bulk.data_out(&data[i * pageSize()], pageSize());
+	    bulk.chip_deselect();
+	    writeCommand(bulk, { opProgramExecute, 0, (uint8_t)(page >> 8), (uint8_t)page });
+	    m_spi.flash_idle(bulk, m_config.pageProgramTime);
+	    status.push_back(getFeature(bulk, regStatus));
+	}
+	bulk.flush();
+
+	size_t next = pages.size();
+	for (size_t i = 0; i < status.size(); i++)
+	{
+	    uint8_t value = (*status[i])[0];
+	    if (value & statusBusy)
+	    {
+		value = waitReady(bulk, 10);
+		next = first + i + 1;
+	    }
+	    if (value & statusProgramFail)
+	    {
+		throw std::runtime_error(Formatter() << "Program failed at page " << pages[first + i] << ".");
+	    }
+	    if (next != pages.size())
+		break;
+	}
+	first = next;
+    }
+}
+
+/* Programs the data ranges of the image. Pages are assembled from the ranges
+ * they overlap, so every page is programmed once. */
+void SpiNand::program(uint32_t addr, const FlashImage &image, StepCallback progress)
+{
+    const uint32_t pagesPerBulk = std::max<uint32_t>(1, bulkSize / pageSize());
+
+    std::vector<uint32_t> pages;
+    std::vector<uint8_t> data;
+    uint32_t pageAddr = 0;
+    uint32_t programmed = 0;
+
+    for (auto &range : image.ranges())
+    {
+	for (uint32_t done = 0; done < range.data.size(); )
+	{
+	    uint32_t byteAddr = addr + range.offset + done;
+	    uint32_t column = byteAddr % pageSize();
+	    uint32_t size = std::min<uint32_t>(pageSize() - column, range.data.size() - done);
+
+	    if (pages.empty() || byteAddr - column != pageAddr)
+	    {
+		if (pages.size() == pagesPerBulk)
+		{
+		    programPages(pages, data);
+		    pages.clear();
+		    data.clear();
+
+		    if (progress)
+			progress(programmed);
+		}
+
+		pageAddr = byteAddr - column;
+		pages.push_back(physicalPage(pageAddr));
+		data.resize(data.size() + pageSize(), 0xFF);
+	    }
+
+	    std::memcpy(&data[data.size() - pageSize() + column], range.data.data() + done, size);
+	    done += size;
+	    programmed += size;
+	}
+    }
+
+    programPages(pages, data);
+
+    if (progress)
+	progress(programmed);
+}
+
+/* Reads in the continuous read mode: one page read starts a run of physically
+ * consecutive good blocks, which then streams out under a single chip select
+ * in chunks of one USB round trip each. */
+void SpiNand::read(uint32_t addr, uint32_t length, DataCallback consumer, StepCallback progress)
+{
+    setBufferMode(false);
+
+    try
+    {
+	readRuns(addr, length, consumer, progress);
+    }
+    catch (...)
+    {
+	// A consumer may stop the read halfway; end the continuous read and
+	// leave the device in the buffer read mode the other commands expect
+	try
+	{
+	    ftditransaction t(m_spi, "NAND read abort");
+	    t.chip_deselect();
+	    t.flush();
+	    setBufferMode(true);
+	}
+	catch (...)
+	{
+	}
+	throw;
+    }
+
+    setBufferMode(true);
+}
+
+void SpiNand::readRuns(uint32_t addr, uint32_t length, DataCallback consumer, StepCallback progress)
+{
+    for (uint32_t done = 0; done < length; )
+    {
+	uint32_t runAddr = addr + done;
+	uint32_t column = runAddr % pageSize();
+	uint32_t page = physicalPage(runAddr - column);
+
+	uint32_t runEnd = runAddr / blockSize() + 1;
+	while (runEnd * blockSize() < addr + length && runEnd < m_goodBlocks.size() &&
+	    m_goodBlocks[runEnd] == m_goodBlocks[runEnd - 1] + 1)
+	{
+	    runEnd++;
+	}
+	uint32_t remaining = std::min(runEnd * blockSize(), addr + length) - runAddr + column;
+
+	ftditransaction t(m_spi, "NAND read");
+	writeCommand(t, { opPageRead, 0, (uint8_t)(page >> 8), (uint8_t)page });
+	m_spi.flash_idle(t, pageReadTime);
+	waitReady(t, 10);
+
+	// The continuous read starts at the first byte of the page
+	t.chip_select();
+	t.data_out({ opReadCache, 0, 0, 0 });
+
+	uint32_t skip = column;
+	while (remaining > 0)
+	{
+	    uint32_t size = std::min(readChunkSize, remaining);
+	    ftdiresult_ptr chunk = t.data_in(size);
+	    if (size == remaining)
+		t.chip_deselect();
+	    t.flush();
+
+	    consumer(chunk->data().data() + skip, size - skip);
+	    done += size - skip;
+	    remaining -= size;
+	    skip = 0;
+
+	    if (progress)
+		progress(done);
+	}
+
+	ftdiresult_ptr status = getFeature(t, regStatus);
+	t.flush();
+	if ((*status)[0] & statusEccUncorrectable)
+	{
+	    throw std::runtime_error(Formatter() << "Uncorrectable ECC error reading from address " << runAddr << ".");
+	}
+    }
+}
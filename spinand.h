@@ -0,0 +1,74 @@
+#ifndef SPI_NAND_H
+#define SPI_NAND_H
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "flashimage.h"
+#include "ftdispi.h"
+
+/*
+ * SPI NAND backend (e.g. Winbond W25N01GV). Data goes through the on-die page
+ * cache: page read (0x13) into the cache and read cache (0x03) out of it,
+ * program load (0x02) into the cache and program execute (0x10) from it;
+ * erases work on whole blocks (0xD8).
+ *
+ * Factory bad blocks, marked by a non-0xFF first spare byte, are found when the
+ * backend is set up and skipped: addresses are logical, counting good blocks
+ * only, so an image is laid out over the good blocks in order.
+ *
+ * Programming queues load, execute and a deferred status read for many pages
+ * per USB transfer; reads use the continuous read mode over runs of good
+ * blocks, so whole blocks stream without a command per page.
+ */
+class SpiNand
+{
+public:
+    typedef std::function<void(uint32_t done)> StepCallback;
+    typedef std::function<void(const uint8_t *data, uint32_t length)> DataCallback;
+
+    static const std::vector<FlashConfig> &memories();
+    static const FlashConfig *findMemory(const uint8_t jedecId[3]);
+
+    // SPI NAND returns its JEDEC ID after a dummy byte
+    static void readId(ftdispi &spi, uint8_t jedecId[3]);
+
+    SpiNand(ftdispi &spi, const FlashConfig &config);
+
+    // Resets the device, clears block protection, enables ECC and scans for bad blocks
+    void init();
+
+    uint32_t pageSize() const                       { return m_config.nandPageSize; }
+    uint32_t blockSize() const                      { return m_config.nandBlockSize; }
+    uint32_t usableSize() const                     { return m_goodBlocks.size() * blockSize(); }
+    const std::vector<uint32_t> &badBlocks() const  { return m_badBlocks; }
+
+    void waitReady();
+    void eraseAll(StepCallback progress);
+    void erase(uint32_t addr, uint32_t length, StepCallback progress);
+    void program(uint32_t addr, const FlashImage &image, StepCallback progress);
+    void read(uint32_t addr, uint32_t length, DataCallback consumer, StepCallback progress);
+
+private:
+    ftdispi &m_spi;
+    FlashConfig m_config;
+    uint32_t m_pagesPerBlock;
+
+    std::vector<uint32_t> m_goodBlocks;     // physical block of each logical block
+    std::vector<uint32_t> m_badBlocks;
+
+    uint32_t physicalPage(uint32_t addr) const;
+
+    void writeCommand(ftditransaction &t, std::initializer_list<uint8_t> cmd);
+    ftdiresult_ptr getFeature(ftditransaction &t, uint8_t reg);
+    void setFeature(ftditransaction &t, uint8_t reg, uint8_t value);
+    uint8_t waitReady(ftditransaction &t, uint32_t timeoutMs);
+    void eraseBlock(uint32_t block);
+    void setBufferMode(bool buffer);
+    void readRuns(uint32_t addr, uint32_t length, DataCallback consumer, StepCallback progress);
+    void scanBadBlocks();
+    void programPages(const std::vector<uint32_t> &pages, const std::vector<uint8_t> &data);
+};
+
+#endif // SPI_NAND_H
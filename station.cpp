@@ -0,0 +1,303 @@
+#include "station.h"
+#include "utils.h"
+
+#include <chrono>
+#include <ctime>
+#include <fnmatch.h>
+#include <iostream>
+#include <stdexcept>
+
+ProductionStation::ProductionStation(const FlashImage &image, const Config &config) :
+    m_image(image),
+    m_config(config),
+    m_stop(false),
+    m_scheduler(config.linkSlots),
+    m_passed(0),
+    m_failed(0)
+{
+    if (!m_config.logPath.empty())
+    {
+	m_log = fopen(m_config.logPath.c_str(), "a");
+	if (m_log == nullptr)
+	{
+	    throw std::runtime_error(Formatter() << "Could not open station log " << m_config.logPath << ".");
+	}
+    }
+
+    int result = libusb_init(&m_usb);
+    if (result != LIBUSB_SUCCESS)
+    {
+	throw std::runtime_error(Formatter() << "Could not initialize libusb: " << libusb_error_name(result));
+    }
+
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+    {
+	libusb_exit(m_usb);
+	throw std::runtime_error("libusb has no hotplug support on this platform.");
+    }
+}
+
+ProductionStation::~ProductionStation()
+{
+    reapWorkers(true);
+    for (auto &arrival : m_arrived)
+    {
+	libusb_unref_device(arrival.device);
+    }
+    libusb_exit(m_usb);
+
+    if (m_log != nullptr)
+    {
+	fclose(m_log);
+    }
+}
+
+/* Runs in the libusb event loop, which must not do USB I/O itself; the board
+ * is only queued here and handled by a worker. */
+int LIBUSB_CALL ProductionStation::hotplug(libusb_context *, libusb_device *device, libusb_hotplug_event event, void *user)
+{
+    ProductionStation *station = static_cast<ProductionStation *>(user);
+
+    if (event != LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+	return 0;
+
+    struct libusb_device_descriptor desc;
+    if (libusb_get_device_descriptor(device, &desc) != LIBUSB_SUCCESS)
+	return 0;
+
+    for (auto &id : station->m_config.ids)
+    {
+	if (desc.idVendor == id.first && desc.idProduct == id.second)
+	{
+	    // libftdi device string selecting this exact bus and address
+	    Arrival arrival;
+	    arrival.device = libusb_ref_device(device);
+	    arrival.devstr = Formatter() << "d:" << (int)libusb_get_bus_number(device) << "/" <<
+		(int)libusb_get_device_address(device);
+
+	    uint8_t ports[8];
+	    int depth = libusb_get_port_numbers(device, ports, sizeof(ports));
+	    if (depth > 0)
+		arrival.links = UsbScheduler::links(libusb_get_bus_number(device), ports, depth);
+
+	    std::lock_guard<std::mutex> lock(station->m_mutex);
+	    station->m_arrived.push_back(arrival);
+	    break;
+	}
+    }
+    return 0;
+}
+
+void ProductionStation::run()
+{
+    // All vendor IDs are accepted here and filtered in the callback, as one
+    // registration can only match a single VID/PID pair
+    int result = libusb_hotplug_register_callback(m_usb, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+	LIBUSB_HOTPLUG_ENUMERATE, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+	&ProductionStation::hotplug, this, &m_hotplug);
+    if (result != LIBUSB_SUCCESS)
+    {
+	throw std::runtime_error(Formatter() << "Could not register hotplug callback: " << libusb_error_name(result));
+    }
+
+    while (!m_stop)
+    {
+	struct timeval timeout = { 0, 250000 };
+	libusb_handle_events_timeout_completed(m_usb, &timeout, nullptr);
+
+	reapWorkers(false);
+	startWorkers();
+    }
+
+    libusb_hotplug_deregister_callback(m_usb, m_hotplug);
+    reapWorkers(true);
+}
+
+void ProductionStation::startWorkers()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    std::vector<Arrival> deferred;
+    for (auto &arrival : m_arrived)
+    {
+	// A new board reusing the address of one still being finished waits for that worker
+	if (m_workers.count(arrival.devstr) != 0)
+	{
+	    deferred.push_back(arrival);
+	    continue;
+	}
+
+	Worker *worker = new Worker();
+	worker->done = false;
+	m_workers[arrival.devstr].reset(worker);
+	worker->thread = std::thread(&ProductionStation::programBoard, this, arrival.device, arrival.devstr,
+	    arrival.links, worker);
+    }
+    m_arrived.swap(deferred);
+}
+
+void ProductionStation::reapWorkers(bool wait)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    for (auto it = m_workers.begin(); it != m_workers.end(); )
+    {
+	if (wait || it->second->done)
+	{
+	    it->second->thread.join();
+	    it = m_workers.erase(it);
+	}
+	else
+	{
+	    ++it;
+	}
+    }
+}
+
+/* Reads iSerialNumber through libusb, which leaves the kernel driver of the
+ * device attached. Returns an empty string if it cannot be read. */
+static std::string deviceSerial(libusb_device *device)
+{
+    struct libusb_device_descriptor desc;
+    if (libusb_get_device_descriptor(device, &desc) != LIBUSB_SUCCESS || desc.iSerialNumber == 0)
+	return "";
+
+    libusb_device_handle *handle = nullptr;
+    if (libusb_open(device, &handle) != LIBUSB_SUCCESS)
+	return "";
+
+    unsigned char serial[128];
+    int length = libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber, serial, sizeof(serial));
+    libusb_close(handle);
+
+    return length > 0 ? std::string((const char *)serial, length) : "";
+}
+
+/* Returns the page program commands for the memory on this board, building
+ * them on the first board with that memory. The build runs outside m_mutex;
+ * boards with the same memory arriving meanwhile wait for its result. A
+ * failed build is retried by the next board. */
+std::shared_ptr<const FlashProgrammer::ProgramBulks> ProductionStation::program(FlashProgrammer &programmer)
+{
+    std::string key = Formatter() << (int)programmer.jedecId()[0] << "." << (int)programmer.jedecId()[1] << "." <<
+	(int)programmer.jedecId()[2];
+
+    std::promise<std::shared_ptr<const FlashProgrammer::ProgramBulks>> build;
+    std::shared_future<std::shared_ptr<const FlashProgrammer::ProgramBulks>> program;
+    bool builder = false;
+    {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_programs.find(key);
+	if (it == m_programs.end())
+	{
+	    it = m_programs.insert(std::make_pair(key, build.get_future().share())).first;
+	    builder = true;
+	}
+	program = it->second;
+    }
+
+    if (builder)
+    {
+	try
+	{
+	    build.set_value(std::make_shared<const FlashProgrammer::ProgramBulks>(
+		programmer.buildProgram(m_config.offset, m_image)));
+	}
+	catch (std::exception &)
+	{
+	    build.set_exception(std::current_exception());
+	    std::lock_guard<std::mutex> lock(m_mutex);
+	    m_programs.erase(key);
+	}
+    }
+    return program.get();
+}
+
+/* Erasing only polls the status register, so it runs without a slot on the
+ * USB links; everything that moves the image holds one for as long as it
+ * runs. */
+void ProductionStation::programBoard(libusb_device *device, const std::string &devstr,
+    const std::vector<std::string> &links, Worker *worker)
+{
+    auto begin = std::chrono::steady_clock::now();
+
+    // Opening with libftdi detaches the serial driver and resets the chip, so
+    // devices of other serial numbers, e.g. consoles, must be skipped before
+    std::string serial = deviceSerial(device);
+    libusb_unref_device(device);
+    if (fnmatch(m_config.serialPattern.c_str(), serial.c_str(), 0) != 0)
+    {
+	worker->done = true;
+	return;
+    }
+
+    try
+    {
+	FlashProgrammer programmer;
+	programmer.open(m_config.ifnum, devstr.c_str());
+	serial = programmer.spi().getSerial();
+
+	if (programmer.identify() == nullptr)
+	{
+	    throw std::runtime_error("Unknown flash memory.");
+	}
+
+	switch (m_config.erase)
+	{
+	case ERASE_CHIP:
+	    programmer.eraseChip();
+	    break;
+	case ERASE_SECTORS:
+	    programmer.eraseSectors(m_config.offset, m_image.size());
+	    break;
+	case ERASE_NONE:
+	    break;
+	}
+
+	programmer.waitReady();
+
+	{
+	    UsbScheduler::Lease lease = m_scheduler.acquire(links);
+
+	    // SPI NAND places the image around each board's own bad blocks
+	    if (programmer.nand() != nullptr)
+		programmer.program(m_config.offset, m_image);
+	    else
+		programmer.program(*program(programmer));
+	    programmer.verify(m_config.offset, m_image);
+	}
+	programmer.powerDown();
+
+	std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - begin;
+	report(devstr, serial, true, "OK", seconds.count());
+    }
+    catch (std::exception &e)
+    {
+	std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - begin;
+	report(devstr, serial, false, e.what(), seconds.count());
+    }
+
+    worker->done = true;
+}
+
+void ProductionStation::report(const std::string &devstr, const std::string &serial, bool pass,
+    const std::string &message, double seconds)
+{
+    (pass ? m_passed : m_failed)++;
+
+    char timestamp[32];
+    time_t now = time(nullptr);
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+
+    std::string line = Formatter() << timestamp << " " << (serial.empty() ? "-" : serial) << " " << devstr << " " <<
+	(pass ? "PASS" : "FAIL") << " " << seconds << "s " << message;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::cout << line << std::endl;
+
+    if (m_log != nullptr)
+    {
+	fprintf(m_log, "%s\n", line.c_str());
+	fflush(m_log);
+    }
+}
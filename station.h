@@ -0,0 +1,107 @@
+#ifndef STATION_H
+#define STATION_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <libusb.h>
+
+#include "flashprogrammer.h"
+#include "scheduler.h"
+
+/*
+ * Production station: waits for programmers to be plugged in and programs
+ * every target that arrives. The image is loaded once and the page program
+ * commands are built once per memory type, so a board only costs its own
+ * erase, program and verify time. Arrivals are reported by libusb hotplug
+ * events; each board is handled by its own worker thread, so several
+ * fixtures can run at once. Boards behind the same hub share its bandwidth:
+ * programming and verify wait for a slot on every hub and root port on the
+ * way, while erases run freely. The result for every board is appended to
+ * a log, one line per serial number.
+ */
+class ProductionStation
+{
+public:
+    enum EraseMode
+    {
+	ERASE_CHIP,
+	ERASE_SECTORS,
+	ERASE_NONE
+    };
+
+    struct Config
+    {
+	std::vector<std::pair<uint16_t, uint16_t>> ids = { { 0x0403, 0x6010 }, { 0x0403, 0x6011 } };
+	std::string serialPattern = "*";        // fnmatch(3) pattern
+	enum ftdi_interface ifnum = INTERFACE_A;
+	uint32_t offset = 0;
+	EraseMode erase = ERASE_CHIP;
+	std::string logPath;
+	unsigned linkSlots = 2;                 // boards programming per hub or root port
+    };
+
+    ProductionStation(const FlashImage &image, const Config &config);
+    ~ProductionStation();
+
+    // Programs boards as they arrive until stop() is called
+    void run();
+    // May be called from a signal handler
+    void stop()                 { m_stop = true; }
+
+    uint32_t passed() const     { return m_passed; }
+    uint32_t failed() const     { return m_failed; }
+
+private:
+    struct Worker
+    {
+	std::thread thread;
+	std::atomic<bool> done;
+    };
+
+    struct Arrival
+    {
+	libusb_device *device;                  // referenced until its worker has read the serial number
+	std::string devstr;
+	std::vector<std::string> links;       // hubs and root port, see UsbScheduler
+    };
+
+    const FlashImage &m_image;
+    Config m_config;
+
+    libusb_context *m_usb = nullptr;
+    libusb_hotplug_callback_handle m_hotplug;
+    std::atomic<bool> m_stop;
+
+    std::mutex m_mutex;
+    std::vector<Arrival> m_arrived;                             // new boards
+    std::map<std::string, std::unique_ptr<Worker>> m_workers;   // by device string
+    std::map<std::string, std::shared_future<std::shared_ptr<const FlashProgrammer::ProgramBulks>>> m_programs; // by JEDEC ID
+    UsbScheduler m_scheduler;
+    FILE *m_log = nullptr;
+    std::atomic<uint32_t> m_passed;
+    std::atomic<uint32_t> m_failed;
+
+    static int LIBUSB_CALL hotplug(libusb_context *ctx, libusb_device *device, libusb_hotplug_event event, void *user);
+
+    void startWorkers();
+    void reapWorkers(bool wait);
+    void programBoard(libusb_device *device, const std::string &devstr, const std::vector<std::string> &links,
+	Worker *worker);
+    std::shared_ptr<const FlashProgrammer::ProgramBulks> program(FlashProgrammer &programmer);
+    void report(const std::string &devstr, const std::string &serial, bool pass, const std::string &message, double seconds);
+
+    ProductionStation(const ProductionStation &);
+    ProductionStation & operator = (ProductionStation &);
+};
+
+#endif // STATION_H
@@ -1,6 +1,7 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <cstdint>
 #include <sstream>
 #include <string>
 
@@ -14,6 +15,12 @@ struct FlashConfig
     uint32_t size;
     uint32_t pageProgramTime;
     uint32_t blockEraseTime64k;
+    uint32_t blockEraseTime64kTyp;
+    uint32_t chipEraseTimeTyp;
+
+    // SPI NAND geometry, zero for SPI NOR
+    uint32_t nandPageSize;
+    uint32_t nandBlockSize;
 };
 
 class Formatter
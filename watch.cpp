@@ -0,0 +1,71 @@
+#include "watch.h"
+#include "utils.h"
+
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+ImageWatcher::ImageWatcher(const std::string &path, uint32_t settleMs) :
+    m_settleMs(settleMs)
+{
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+    m_name = slash == std::string::npos ? path : path.substr(slash + 1);
+
+    m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m_fd < 0)
+    {
+	throw std::runtime_error(Formatter() << "Could not initialize inotify: " << strerror(errno));
+    }
+
+    if (inotify_add_watch(m_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+	int error = errno;
+	close(m_fd);
+	throw std::runtime_error(Formatter() << "Could not watch " << dir << ": " << strerror(error));
+    }
+}
+
+ImageWatcher::~ImageWatcher()
+{
+    close(m_fd);
+}
+
+int ImageWatcher::readEvents(int timeoutMs)
+{
+    struct pollfd pfd = { m_fd, POLLIN, 0 };
+    if (poll(&pfd, 1, timeoutMs) <= 0)
+	return -1;
+
+    // Event records are aligned for struct inotify_event
+    alignas(struct inotify_event) char buffer[4096];
+    bool match = false;
+
+    ssize_t size;
+    while ((size = read(m_fd, buffer, sizeof(buffer))) > 0)
+    {
+	for (char *p = buffer; p < buffer + size; )
+	{
+	    struct inotify_event *event = (struct inotify_event *)p;
+	    if (event->len > 0 && m_name == event->name)
+		match = true;
+	    p += sizeof(struct inotify_event) + event->len;
+	}
+    }
+    return match;
+}
+
+bool ImageWatcher::wait(int timeoutMs)
+{
+    if (readEvents(timeoutMs) != 1)
+	return false;
+
+    // Let the build finish writing
+    while (readEvents(m_settleMs) >= 0)
+    {
+    }
+    return true;
+}
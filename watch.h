@@ -0,0 +1,34 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <cstdint>
+#include <string>
+
+/*
+ * Waits for an image file to be rewritten, e.g. by a build. The directory is
+ * watched with inotify rather than the file itself, so images replaced by a
+ * rename are seen as well; a burst of events counts as one change once the
+ * directory has been quiet for the settle time.
+ */
+class ImageWatcher
+{
+public:
+    explicit ImageWatcher(const std::string &path, uint32_t settleMs = 200);
+    ~ImageWatcher();
+
+    // Returns true when the file has changed, false after the timeout
+    bool wait(int timeoutMs);
+
+private:
+    int m_fd;
+    std::string m_name;
+    uint32_t m_settleMs;
+
+    // Waits for events; returns -1 on timeout, else whether one concerned the file
+    int readEvents(int timeoutMs);
+
+    ImageWatcher(const ImageWatcher &);
+    ImageWatcher & operator = (ImageWatcher &);
+};
+
+#endif // WATCH_H